@@ -0,0 +1,702 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "parser.hpp"
+#include "scheduler.hpp"
+#include "png.hpp"
+#include "scene.hpp"
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <exception>
+#include <dirent.h>
+
+// synthetic scenes that each stress one part of the renderer, every generator takes a factor that scales its size.
+// with --golden the same scenes and a corpus of SVG files are rendered by every engine and compared to references
+
+namespace {
+
+class Random {
+	std::uint64_t state = 0x2545F4914F6CDD1D;
+public:
+	float next(float min, float max) {
+		// xorshift64
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return min + (max - min) * static_cast<float>(state >> 40) / static_cast<float>(1 << 24);
+	}
+};
+
+std::string color(Random& random) {
+	std::ostringstream s;
+	s << "rgb(" << static_cast<int>(random.next(0.f, 255.f)) << "," << static_cast<int>(random.next(0.f, 255.f)) << "," << static_cast<int>(random.next(0.f, 255.f)) << ")";
+	return s.str();
+}
+
+std::string header(int width, int height) {
+	std::ostringstream s;
+	s << "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"" << width << "\" height=\"" << height << "\">\n";
+	return s.str();
+}
+
+// the number of elements of a scene of the given size, at least one so that small sizes still draw something
+int get_count(int count, float size) {
+	return std::max(static_cast<int>(count * size), 1);
+}
+
+// many small rectangles, stresses the shape index and the per shape overhead
+std::string generate_rects(float size) {
+	Random random;
+	std::ostringstream s;
+	s << header(1024, 1024);
+	const int count = get_count(20000, size);
+	for (int i = 0; i < count; ++i) {
+		s << "<rect x=\"" << random.next(0.f, 1016.f) << "\" y=\"" << random.next(0.f, 1016.f) << "\" width=\"" << random.next(2.f, 8.f) << "\" height=\"" << random.next(2.f, 8.f) << "\" fill=\"" << color(random) << "\"/>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+// a single path with a million segments, stresses the path parser and the sweep
+std::string generate_huge_path(float size) {
+	std::ostringstream s;
+	s << header(1024, 1024);
+	s << "<path fill=\"navy\" d=\"M";
+	const int count = get_count(1000000, size);
+	for (int i = 0; i < count; ++i) {
+		const float a = 2.f * 3.14159265f * i / count;
+		const float r = 400.f + 80.f * std::sin(a * 997.f);
+		s << " " << 512.f + r * std::cos(a) << " " << 512.f + r * std::sin(a);
+	}
+	s << " Z\"/>\n</svg>\n";
+	return s.str();
+}
+
+// overlapping stars whose edges intersect each other many times, stresses the intersection handling of the sweep
+std::string generate_stars(float size) {
+	Random random;
+	std::ostringstream s;
+	s << header(1024, 1024);
+	const int count = get_count(20, size);
+	for (int i = 0; i < count; ++i) {
+		const float cx = random.next(100.f, 924.f);
+		const float cy = random.next(100.f, 924.f);
+		const float r = random.next(40.f, 200.f);
+		s << "<polygon fill=\"" << color(random) << "\" fill-opacity=\"0.5\" points=\"";
+		// a {61/29} star polygon
+		for (int j = 0; j < 61; ++j) {
+			const float a = 2.f * 3.14159265f * j * 29 / 61;
+			s << cx + r * std::cos(a) << "," << cy + r * std::sin(a) << " ";
+		}
+		s << "\"/>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+// deeply nested groups with a transformation and a shape at every level, stresses the parser's state handling
+std::string generate_nesting(float size) {
+	std::ostringstream s;
+	s << header(1024, 1024);
+	const int depth = get_count(50, size);
+	for (int i = 0; i < depth; ++i) {
+		s << "<g transform=\"translate(512 512) rotate(3) scale(0.99) translate(-512 -512)\" fill-opacity=\"0.9\">\n";
+		s << "<rect x=\"312\" y=\"312\" width=\"400\" height=\"400\" fill=\"" << (i % 2 ? "orange" : "teal") << "\"/>\n";
+	}
+	for (int i = 0; i < depth; ++i) {
+		s << "</g>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+// large shapes filled with gradients, stresses the paint evaluation
+std::string generate_gradients(float size) {
+	Random random;
+	std::ostringstream s;
+	s << header(1024, 1024);
+	const int count = get_count(500, size);
+	s << "<defs>\n";
+	for (int i = 0; i < count; ++i) {
+		if (i % 2 == 0) {
+			s << "<linearGradient id=\"g" << i << "\" x1=\"0\" y1=\"0\" x2=\"1\" y2=\"1\">\n";
+		}
+		else {
+			s << "<radialGradient id=\"g" << i << "\" cx=\"0.5\" cy=\"0.5\" r=\"0.5\" fx=\"0.3\" fy=\"0.3\">\n";
+		}
+		s << "<stop offset=\"0\" stop-color=\"" << color(random) << "\"/>\n";
+		s << "<stop offset=\"0.5\" stop-color=\"" << color(random) << "\" stop-opacity=\"0.5\"/>\n";
+		s << "<stop offset=\"1\" stop-color=\"" << color(random) << "\"/>\n";
+		s << (i % 2 == 0 ? "</linearGradient>\n" : "</radialGradient>\n");
+	}
+	s << "</defs>\n";
+	for (int i = 0; i < count; ++i) {
+		s << "<rect x=\"" << random.next(0.f, 824.f) << "\" y=\"" << random.next(0.f, 824.f) << "\" width=\"200\" height=\"200\" fill=\"url(#g" << i << ")\"/>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+// curves with wide strokes and round joins, stresses the stroker
+std::string generate_strokes(float size) {
+	Random random;
+	std::ostringstream s;
+	s << header(1024, 1024);
+	const int count = get_count(10, size);
+	for (int i = 0; i < count; ++i) {
+		s << "<path fill=\"none\" stroke=\"" << color(random) << "\" stroke-width=\"" << random.next(20.f, 60.f) << "\" stroke-linejoin=\"round\" stroke-linecap=\"round\" stroke-opacity=\"0.7\" d=\"M " << random.next(0.f, 1024.f) << " " << random.next(0.f, 1024.f);
+		for (int j = 0; j < 4; ++j) {
+			s << " C";
+			for (int k = 0; k < 3; ++k) {
+				s << " " << random.next(0.f, 1024.f) << " " << random.next(0.f, 1024.f);
+			}
+		}
+		s << "\"/>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+// a few shapes on a big canvas, stresses the pixel loops and the encoder
+std::string generate_big_canvas(float size) {
+	Random random;
+	std::ostringstream s;
+	const int extent = 4096 * std::sqrt(size);
+	s << header(extent, extent);
+	s << "<rect width=\"" << extent << "\" height=\"" << extent << "\" fill=\"white\"/>\n";
+	for (int i = 0; i < 20; ++i) {
+		s << "<circle cx=\"" << random.next(0.f, extent) << "\" cy=\"" << random.next(0.f, extent) << "\" r=\"" << random.next(extent / 50.f, extent / 5.f) << "\" fill=\"" << color(random) << "\" fill-opacity=\"0.6\"/>\n";
+	}
+	s << "</svg>\n";
+	return s.str();
+}
+
+struct Benchmark {
+	const char* name;
+	std::string (*generate)(float size);
+};
+
+const Benchmark benchmarks[] = {
+	{"rects", generate_rects},
+	{"huge_path", generate_huge_path},
+	{"stars", generate_stars},
+	{"nesting", generate_nesting},
+	{"gradients", generate_gradients},
+	{"strokes", generate_strokes},
+	{"big_canvas", generate_big_canvas}
+};
+
+// counts the bytes written to it and drops them
+class CountingBuffer: public std::streambuf {
+	size_t count = 0;
+protected:
+	int overflow(int c) override {
+		++count;
+		return traits_type::not_eof(c);
+	}
+	std::streamsize xsputn(const char*, std::streamsize n) override {
+		count += n;
+		return n;
+	}
+public:
+	size_t get_count() const {
+		return count;
+	}
+};
+
+using Clock = std::chrono::steady_clock;
+
+double get_seconds(Clock::duration duration) {
+	return std::chrono::duration<double>(duration).count();
+}
+
+struct Result {
+	size_t svg_bytes = 0;
+	size_t shapes = 0;
+	size_t segments = 0;
+	size_t pixels = 0;
+	size_t encoded_bytes = 0;
+	// the fastest of all repetitions for every stage
+	double generate = 0.0;
+	double parse = 0.0;
+	double raster = 0.0;
+	double encode = 0.0;
+};
+
+Result run(const Benchmark& benchmark, float size, int repeat, const RenderOptions& options) {
+	Result result;
+	Clock::time_point start = Clock::now();
+	const std::string svg = benchmark.generate(size);
+	result.generate = get_seconds(Clock::now() - start);
+	result.svg_bytes = svg.size();
+	Renderer renderer;
+	for (int i = 0; i < repeat; ++i) {
+		start = Clock::now();
+		const Document document = parse(svg, options);
+		const double parse_time = get_seconds(Clock::now() - start);
+		result.shapes = document.shapes.size();
+		result.segments = document.get_segments().size;
+		const size_t width = document.width;
+		const size_t height = document.height;
+		result.pixels = width * height;
+		// the bands are encoded as they are rendered, the time spent in the encoder is subtracted from the render
+		CountingBuffer buffer;
+		std::ostream stream(&buffer);
+		ImageWriter writer(stream, ImageWriter::Format::PNG, width, height);
+		Clock::duration encode_duration = Clock::duration::zero();
+		start = Clock::now();
+		renderer.render(document, Rectangle(0.f, 0.f, width, height), options, [&](const Pixmap& band) {
+			const Clock::time_point encode_start = Clock::now();
+			writer.write_rows(band);
+			encode_duration += Clock::now() - encode_start;
+		});
+		const double encode_time = get_seconds(encode_duration);
+		const double raster_time = get_seconds(Clock::now() - start) - encode_time;
+		result.encoded_bytes = buffer.get_count();
+		if (i == 0 || parse_time < result.parse) result.parse = parse_time;
+		if (i == 0 || raster_time < result.raster) result.raster = raster_time;
+		if (i == 0 || encode_time < result.encode) result.encode = encode_time;
+	}
+	return result;
+}
+
+double get_rate(double amount, double seconds) {
+	return seconds > 0.0 ? amount / seconds : 0.0;
+}
+
+void print_result(const char* name, float size, const Result& result) {
+	std::ostringstream s;
+	s << "{\"scene\": \"" << name << "\", \"size\": " << size;
+	s << ", \"svg_bytes\": " << result.svg_bytes << ", \"shapes\": " << result.shapes << ", \"segments\": " << result.segments << ", \"pixels\": " << result.pixels << ", \"encoded_bytes\": " << result.encoded_bytes;
+	s << ", \"generate_ms\": " << result.generate * 1e3 << ", \"parse_ms\": " << result.parse * 1e3 << ", \"raster_ms\": " << result.raster * 1e3 << ", \"encode_ms\": " << result.encode * 1e3;
+	s << ", \"parse_mb_per_s\": " << get_rate(result.svg_bytes, result.parse) / 1e6;
+	s << ", \"segments_per_s\": " << get_rate(result.segments, result.raster);
+	s << ", \"pixels_per_s\": " << get_rate(result.pixels, result.raster);
+	s << ", \"encoded_mb_per_s\": " << get_rate(result.encoded_bytes, result.encode) / 1e6 << "}";
+	std::cout << s.str() << std::endl;
+}
+
+// the engines that are compared to the references. the float and the fixed point geometry each have their own
+// references, rendered by the engine marked as reference. the errors are the differences of the premultiplied channels
+// in 8 bit levels, the largest one and the mean over all pixels are limited
+struct Engine {
+	const char* name;
+	bool fixed_point;
+	bool compiled;
+	bool reference;
+	size_t threads;
+	int max_error;
+	double max_mean_error;
+};
+
+const Engine engines[] = {
+	{"float", false, false, true, 1, 0, 0.0},
+	{"float_bands", false, false, false, 4, 0, 0.0},
+	{"fixed", true, false, true, 1, 0, 0.0},
+	{"fixed_bands", true, false, false, 4, 0, 0.0},
+	{"compiled", false, true, false, 1, 2, .1}
+};
+
+// the option combinations that every scene is compared in. the scale multiplies the scale of the command line, the other
+// options replace the ones of the command line unless they are 0. preview uses the options of raster --preview
+struct Variant {
+	const char* name;
+	float scale;
+	float tolerance;
+	float min_size;
+	float simplify;
+};
+
+const Variant variants[] = {
+	{"default", 1.f, 0.f, 0.f, 0.f},
+	{"scale", 2.f, 0.f, 0.f, 0.f},
+	{"tolerance", 1.f, 1.f, 0.f, 0.f},
+	{"min_size", 1.f, 0.f, 2.f, 0.f},
+	{"simplify", 1.f, 0.f, 0.f, .5f},
+	{"preview", .25f, .5f, 1.f, 0.f}
+};
+
+RenderOptions get_options(const Variant& variant, const RenderOptions& options) {
+	RenderOptions result = options;
+	result.scale = options.scale * variant.scale;
+	if (variant.tolerance != 0.f) result.tolerance = variant.tolerance;
+	if (variant.min_size != 0.f) result.min_size = variant.min_size;
+	if (variant.simplify != 0.f) result.simplify = variant.simplify;
+	return result;
+}
+
+struct GoldenScene {
+	std::string name;
+	std::string svg;
+};
+
+struct Image {
+	size_t width = 0;
+	size_t height = 0;
+	// unpremultiplied RGBA with 8 bits per channel
+	std::string pixels;
+	int get_channel(size_t i) const {
+		return static_cast<unsigned char>(pixels[i]);
+	}
+	// the channel premultiplied by alpha, differences in transparent pixels do not count
+	int get_premultiplied(size_t pixel, int channel) const {
+		const int alpha = get_channel(pixel * 4 + 3);
+		return channel == 3 ? alpha : (get_channel(pixel * 4 + channel) * alpha + 127) / 255;
+	}
+};
+
+std::string read_file(const std::string& file_name) {
+	std::ifstream file(file_name, std::ios::binary);
+	if (!file) {
+		throw std::string("could not open ") + file_name;
+	}
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// the references are stored as PAM files so that they can be read back without a PNG decoder
+void write_pam(const Image& image, const std::string& file_name) {
+	std::ofstream file(file_name, std::ios::binary);
+	if (!file) {
+		throw std::string("could not open ") + file_name;
+	}
+	file << "P7\nWIDTH " << image.width << "\nHEIGHT " << image.height << "\nDEPTH 4\nMAXVAL 255\nTUPLTYPE RGB_ALPHA\nENDHDR\n";
+	file << image.pixels;
+}
+
+bool read_pam(const std::string& file_name, Image& image) {
+	std::ifstream file(file_name, std::ios::binary);
+	if (!file) {
+		return false;
+	}
+	std::string line;
+	std::getline(file, line);
+	if (line != "P7") {
+		throw std::string(file_name) + " is not a PAM file";
+	}
+	while (std::getline(file, line) && line != "ENDHDR") {
+		std::istringstream s(line);
+		std::string key;
+		s >> key;
+		if (key == "WIDTH") s >> image.width;
+		else if (key == "HEIGHT") s >> image.height;
+	}
+	image.pixels.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	if (image.pixels.size() != image.width * image.height * 4) {
+		throw std::string(file_name) + " is truncated";
+	}
+	return true;
+}
+
+Image render_image(const Document& document, const Engine& engine, const RenderOptions& options) {
+	Image image;
+	image.width = document.width;
+	image.height = document.height;
+	RenderOptions engine_options = options;
+	engine_options.fixed_point = engine.fixed_point;
+	Scheduler scheduler(engine.threads);
+	std::vector<Renderer> renderers(scheduler.get_thread_count());
+	std::ostringstream stream;
+	ImageWriter writer(stream, ImageWriter::Format::RGBA, image.width, image.height);
+	write_image(scheduler, renderers, document, Rectangle(0.f, 0.f, image.width, image.height), engine_options, writer);
+	image.pixels = stream.str();
+	return image;
+}
+
+struct Comparison {
+	int max_error = 0;
+	double mean_error = 0.0;
+	size_t different_pixels = 0;
+	bool passed(const Engine& engine) const {
+		return max_error <= engine.max_error && mean_error <= engine.max_mean_error;
+	}
+};
+
+// compares the images, if they differ more than the engine allows the differences are written in red over the dimmed
+// reference
+Comparison compare(const Image& reference, const Image& image, const Engine& engine, const std::string& diff_file_name) {
+	Comparison comparison;
+	if (image.width != reference.width || image.height != reference.height) {
+		throw std::string("the size differs from the reference");
+	}
+	Pixmap diff(image.width, image.height);
+	size_t total_error = 0;
+	for (size_t y = 0; y < image.height; ++y) {
+		for (size_t x = 0; x < image.width; ++x) {
+			const size_t pixel = y * image.width + x;
+			int error = 0;
+			for (int channel = 0; channel < 4; ++channel) {
+				error = std::max(error, std::abs(image.get_premultiplied(pixel, channel) - reference.get_premultiplied(pixel, channel)));
+			}
+			total_error += error;
+			comparison.max_error = std::max(comparison.max_error, error);
+			const float grey = (reference.get_premultiplied(pixel, 0) + reference.get_premultiplied(pixel, 1) + reference.get_premultiplied(pixel, 2)) / (3.f * 255.f) * .25f;
+			if (error > 0) {
+				++comparison.different_pixels;
+				diff.add_pixel(x, y, Color(.5f + .5f * std::min(error / 16.f, 1.f), grey, grey));
+			}
+			else {
+				diff.add_pixel(x, y, Color(grey, grey, grey));
+			}
+		}
+	}
+	if (image.width * image.height > 0) {
+		comparison.mean_error = static_cast<double>(total_error) / (image.width * image.height);
+	}
+	if (!comparison.passed(engine)) {
+		write_png(diff, diff_file_name.c_str());
+	}
+	return comparison;
+}
+
+// renders every scene in every variant with every engine, returns the number of failed comparisons. with update the
+// references are rendered and written instead. the diffs and the temporary scene files are written to the output
+// directory
+size_t run_golden(const std::vector<GoldenScene>& scenes, const std::string& directory, const std::string& output, bool update, const RenderOptions& options) {
+	size_t failures = 0;
+	for (const GoldenScene& scene: scenes) {
+		for (const Variant& variant: variants) {
+			const std::string name = scene.name + "." + variant.name;
+			const RenderOptions variant_options = get_options(variant, options);
+			try {
+				const Document document = parse(scene.svg, variant_options);
+				for (const Engine& engine: engines) {
+					// the fixed point references are named after the scene, the variant and fixed
+					const std::string reference_file_name = directory + "/" + name + (engine.fixed_point ? ".fixed" : "") + ".pam";
+					if (update) {
+						if (engine.reference) {
+							write_pam(render_image(document, engine, variant_options), reference_file_name);
+							std::cout << "{\"scene\": \"" << scene.name << "\", \"variant\": \"" << variant.name << "\", \"updated\": \"" << reference_file_name << "\"}" << std::endl;
+						}
+						continue;
+					}
+					try {
+						Image reference;
+						if (!read_pam(reference_file_name, reference)) {
+							throw std::string("no reference, run with --update first");
+						}
+						Image image;
+						if (engine.compiled) {
+							// the scene file round trip replaces the paints with their compiled form
+							const std::string scene_file_name = output + "/" + name + ".scene";
+							write_scene(document, scene_file_name.c_str());
+							image = render_image(read_scene(scene_file_name.c_str()), engine, variant_options);
+							std::remove(scene_file_name.c_str());
+						}
+						else {
+							image = render_image(document, engine, variant_options);
+						}
+						const std::string diff_file_name = output + "/" + name + "." + engine.name + ".diff.png";
+						const Comparison comparison = compare(reference, image, engine, diff_file_name);
+						const bool passed = comparison.passed(engine);
+						if (!passed) {
+							++failures;
+						}
+						std::ostringstream s;
+						s << "{\"scene\": \"" << scene.name << "\", \"variant\": \"" << variant.name << "\", \"engine\": \"" << engine.name << "\"";
+						s << ", \"max_error\": " << comparison.max_error << ", \"mean_error\": " << comparison.mean_error << ", \"different_pixels\": " << comparison.different_pixels;
+						s << ", \"passed\": " << (passed ? "true" : "false");
+						if (!passed) {
+							s << ", \"diff\": \"" << diff_file_name << "\"";
+						}
+						s << "}";
+						std::cout << s.str() << std::endl;
+					} catch (const std::string& error) {
+						std::cerr << "error: " << name << ": " << engine.name << ": " << error << std::endl;
+						++failures;
+					} catch (const std::exception& error) {
+						std::cerr << "error: " << name << ": " << engine.name << ": " << error.what() << std::endl;
+						++failures;
+					}
+				}
+			} catch (const std::string& error) {
+				std::cerr << "error: " << name << ": " << error << std::endl;
+				++failures;
+			} catch (const std::exception& error) {
+				std::cerr << "error: " << name << ": " << error.what() << std::endl;
+				++failures;
+			}
+		}
+	}
+	return failures;
+}
+
+// adds the SVG files of the directory sorted by name
+void add_corpus(const std::string& directory, std::vector<GoldenScene>& scenes) {
+	DIR* dir = opendir(directory.c_str());
+	if (!dir) {
+		throw std::string("could not open ") + directory;
+	}
+	std::vector<std::string> names;
+	while (const dirent* entry = readdir(dir)) {
+		const std::string name = entry->d_name;
+		if (name.size() > 4 && name.compare(name.size() - 4, 4, ".svg") == 0) {
+			names.push_back(name);
+		}
+	}
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+	for (const std::string& name: names) {
+		scenes.push_back(GoldenScene{name.substr(0, name.size() - 4), read_file(directory + "/" + name)});
+	}
+}
+
+void print_usage() {
+	std::cout << "usage: raster_bench [options] [scene...]" << std::endl;
+	std::cout << "       raster_bench --golden <references> [--update] [--corpus <directory>] [--output <directory>] [options] [scene...]" << std::endl;
+	std::cout << "prints one JSON object per scene with the time of every stage and the throughput" << std::endl;
+	std::cout << "scenes:";
+	for (const Benchmark& benchmark: benchmarks) {
+		std::cout << " " << benchmark.name;
+	}
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  --size <factor>       scale the number of elements of every scene (default 1)" << std::endl;
+	std::cout << "  --repeat <n>          report the fastest of n runs (default 3)" << std::endl;
+	std::cout << "  --scale <factor>      scale the output" << std::endl;
+	std::cout << "  --tolerance <pixels>  curve flattening tolerance (default 0.1)" << std::endl;
+	std::cout << "  --min-size <pixels>   cull subpaths smaller than this" << std::endl;
+	std::cout << "  --simplify <pixels>   remove detail below this error" << std::endl;
+	std::cout << "  --fixed               use fixed point geometry" << std::endl;
+	std::cout << "  --memory-budget <bytes>  render in bands that fit into this memory (default 256 MiB, none for golden images)" << std::endl;
+	std::cout << "  --golden <directory>  compare every engine to the reference images in the directory" << std::endl;
+	std::cout << "  --update              render the reference images instead of comparing to them" << std::endl;
+	std::cout << "  --corpus <directory>  compare the SVG files of the directory, the synthetic scenes only if they are named" << std::endl;
+	std::cout << "  --output <directory>  write the diffs here instead of next to the references" << std::endl;
+	std::cout << "golden images are compared at --size 0.1 by default, in every variant:";
+	for (const Variant& variant: variants) {
+		std::cout << " " << variant.name;
+	}
+	std::cout << std::endl;
+}
+
+}
+
+int main(int argc, char** argv) {
+	float size = 0.f;
+	int repeat = 3;
+	const char* golden = nullptr;
+	const char* output = nullptr;
+	bool update = false;
+	std::vector<const char*> corpus;
+	RenderOptions options;
+	std::vector<const Benchmark*> selected;
+	for (int i = 1; i < argc; ++i) {
+		const std::string argument = argv[i];
+		if (argument == "--size" && i + 1 < argc) {
+			size = std::atof(argv[++i]);
+		}
+		else if (argument == "--repeat" && i + 1 < argc) {
+			repeat = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (argument == "--scale" && i + 1 < argc) {
+			options.scale = std::atof(argv[++i]);
+		}
+		else if (argument == "--tolerance" && i + 1 < argc) {
+			options.tolerance = std::atof(argv[++i]);
+		}
+		else if (argument == "--min-size" && i + 1 < argc) {
+			options.min_size = std::atof(argv[++i]);
+		}
+		else if (argument == "--simplify" && i + 1 < argc) {
+			options.simplify = std::atof(argv[++i]);
+		}
+		else if (argument == "--fixed") {
+			options.fixed_point = true;
+		}
+		else if (argument == "--memory-budget" && i + 1 < argc) {
+			options.memory_budget = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (argument == "--golden" && i + 1 < argc) {
+			golden = argv[++i];
+		}
+		else if (argument == "--update") {
+			update = true;
+		}
+		else if (argument == "--corpus" && i + 1 < argc) {
+			corpus.push_back(argv[++i]);
+		}
+		else if (argument == "--output" && i + 1 < argc) {
+			output = argv[++i];
+		}
+		else if (argument == "--help") {
+			print_usage();
+			return 0;
+		}
+		else {
+			const Benchmark* benchmark = nullptr;
+			for (const Benchmark& b: benchmarks) {
+				if (argument == b.name) {
+					benchmark = &b;
+				}
+			}
+			if (!benchmark) {
+				std::cerr << "error: unknown scene " << argument << std::endl;
+				return 1;
+			}
+			selected.push_back(benchmark);
+		}
+	}
+	if (selected.empty() && corpus.empty()) {
+		for (const Benchmark& benchmark: benchmarks) {
+			selected.push_back(&benchmark);
+		}
+	}
+	if (golden) {
+		try {
+			// small scenes keep the comparison of all engines fast
+			if (size == 0.f) {
+				size = .1f;
+			}
+			std::vector<GoldenScene> scenes;
+			for (const char* directory: corpus) {
+				add_corpus(directory, scenes);
+			}
+			for (const Benchmark* benchmark: selected) {
+				scenes.push_back(GoldenScene{benchmark->name, benchmark->generate(size)});
+			}
+			// the references are named after the scenes
+			for (size_t i = 0; i < scenes.size(); ++i) {
+				for (size_t j = 0; j < i; ++j) {
+					if (scenes[i].name == scenes[j].name) {
+						throw std::string("two scenes are named ") + scenes[i].name;
+					}
+				}
+			}
+			const size_t failures = run_golden(scenes, golden, output ? output : golden, update, options);
+			if (failures > 0) {
+				std::cerr << failures << " comparisons failed" << std::endl;
+				return 1;
+			}
+		} catch (const std::string& error) {
+			std::cerr << "error: " << error << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (size == 0.f) {
+		size = 1.f;
+	}
+	if (options.memory_budget == 0) {
+		options.memory_budget = 256 << 20;
+	}
+	for (const Benchmark* benchmark: selected) {
+		try {
+			print_result(benchmark->name, size, run(*benchmark, size, repeat, options));
+		} catch (const std::string& error) {
+			std::cerr << "error: " << benchmark->name << ": " << error << std::endl;
+			return 1;
+		}
+	}
+}
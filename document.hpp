@@ -8,6 +8,7 @@ All rights reserved.
 #include "rasterizer.hpp"
 #include <cmath>
 #include <algorithm>
+#include <map>
 
 struct Transformation {
 	// +-     -+
@@ -29,6 +30,11 @@ struct Transformation {
 		const float s = std::sin(a);
 		return Transformation(c, s, -s, c, 0.f, 0.f);
 	}
+	// whether the transformation only rotates, reflects, translates and scales uniformly
+	bool is_conformal() const {
+		const float epsilon = 1e-6f * (std::abs(a) + std::abs(b));
+		return (std::abs(a - d) <= epsilon && std::abs(b + c) <= epsilon) || (std::abs(a + d) <= epsilon && std::abs(b - c) <= epsilon);
+	}
 	Transformation invert() const {
 		const float det = a * d - b * c;
 		return Transformation(
@@ -63,24 +69,202 @@ constexpr Transformation operator *(const Transformation& t0, const Transformati
 struct Subpath {
 	std::vector<Point> points;
 	bool closed = false;
+};
+
+enum class LineJoin {
+	MITER,
+	ROUND,
+	BEVEL
+};
+
+enum class LineCap {
+	BUTT,
+	ROUND,
+	SQUARE
+};
+
+struct StrokeStyle {
+	float width;
+	LineJoin line_join;
+	LineCap line_cap;
+	float miter_limit;
+	constexpr StrokeStyle(float width, LineJoin line_join = LineJoin::MITER, LineCap line_cap = LineCap::BUTT, float miter_limit = 4.f): width(width), line_join(line_join), line_cap(line_cap), miter_limit(miter_limit) {}
+};
+
+// computes the outline of a stroked subpath as closed subpaths that are filled using the nonzero rule
+class Stroker {
+	StrokeStyle style;
+	float offset;
+	float angle_step;
 	static float length(const Point& p) {
 		return std::sqrt(dot(p, p));
 	}
-	void push_offset_segment(const Point& p0, const Point& p1, float offset) {
-		Point d = p1 - p0;
-		if (length(d) == 0.f) {
+	static constexpr Point left(const Point& d) {
+		return Point(-d.y, d.x);
+	}
+	static constexpr float cross(const Point& p0, const Point& p1) {
+		return p0.x * p1.y - p0.y * p1.x;
+	}
+	static Point rotate(const Point& p, float a) {
+		const float c = std::cos(a);
+		const float s = std::sin(a);
+		return Point(p.x * c - p.y * s, p.x * s + p.y * c);
+	}
+	// appends the points of an arc around center starting at center + from, excluding its end points
+	void add_arc(Subpath& outline, const Point& center, const Point& from, float sweep) const {
+		const int n = std::ceil(std::abs(sweep) / angle_step);
+		for (int i = 1; i < n; ++i) {
+			outline.points.push_back(center + rotate(from, sweep * i / n));
+		}
+	}
+	void add_join(Subpath& outline, const Point& p, const Point& d0, const Point& d1) const {
+		const Point n0 = left(d0) * offset;
+		const Point n1 = left(d1) * offset;
+		const float c = cross(d0, d1);
+		const float cos_angle = dot(d0, d1);
+		if (c > 0.f || (c == 0.f && cos_angle > 0.f)) {
+			// inner side of the join, connect through the vertex
+			outline.points.push_back(p + n0);
+			if (c > 0.f) {
+				outline.points.push_back(p);
+			}
+			outline.points.push_back(p + n1);
 			return;
 		}
-		d = d * (offset / length(d));
-		d = Point(-d.y, d.x);
-		points.push_back(p0 + d);
-		points.push_back(p1 + d);
+		if (style.line_join == LineJoin::MITER && 1.f + cos_angle > 0.f && 2.f / (1.f + cos_angle) <= style.miter_limit * style.miter_limit) {
+			outline.points.push_back(p + (n0 + n1) * (1.f / (1.f + cos_angle)));
+			return;
+		}
+		outline.points.push_back(p + n0);
+		if (style.line_join == LineJoin::ROUND) {
+			add_arc(outline, p, n0, std::atan2(c, cos_angle));
+		}
+		outline.points.push_back(p + n1);
+	}
+	// appends the end cap at p for a subpath ending in direction d
+	void add_cap(Subpath& outline, const Point& p, const Point& d) const {
+		const Point n = left(d) * offset;
+		if (style.line_cap == LineCap::SQUARE) {
+			outline.points.push_back(p + n + d * offset);
+			outline.points.push_back(p - n + d * offset);
+		}
+		else if (style.line_cap == LineCap::ROUND) {
+			add_arc(outline, p, n, -M_PI);
+		}
+	}
+	static Point direction(const Point& p0, const Point& p1) {
+		const Point d = p1 - p0;
+		return d * (1.f / length(d));
+	}
+	// appends the offset of the left side of the points including the joins
+	void add_side(Subpath& outline, const std::vector<Point>& points, bool closed) const {
+		const size_t n = points.size();
+		if (closed) {
+			Point d0 = direction(points[n-1], points[0]);
+			for (size_t i = 0; i < n; ++i) {
+				const Point d1 = direction(points[i], points[(i+1) % n]);
+				add_join(outline, points[i], d0, d1);
+				d0 = d1;
+			}
+		}
+		else {
+			Point d0 = direction(points[0], points[1]);
+			outline.points.push_back(points[0] + left(d0) * offset);
+			for (size_t i = 1; i + 1 < n; ++i) {
+				const Point d1 = direction(points[i], points[i+1]);
+				add_join(outline, points[i], d0, d1);
+				d0 = d1;
+			}
+			outline.points.push_back(points[n-1] + left(d0) * offset);
+		}
+	}
+public:
+	Stroker(const StrokeStyle& style, float angle_step): style(style), offset(style.width / 2.f), angle_step(angle_step) {}
+	void stroke(const Subpath& subpath, std::vector<Subpath>& outlines) const {
+		std::vector<Point> points;
+		for (const Point& p: subpath.points) {
+			if (points.empty() || !(points.back() == p)) {
+				points.push_back(p);
+			}
+		}
+		if (subpath.closed && points.size() > 1 && points.back() == points.front()) {
+			points.pop_back();
+		}
+		if (points.empty()) {
+			return;
+		}
+		if (points.size() == 1) {
+			// a zero length subpath is only visible with round or square caps
+			const Point& p = points.front();
+			Subpath outline;
+			if (style.line_cap == LineCap::ROUND) {
+				outline.points.push_back(p + Point(offset, 0.f));
+				add_arc(outline, p, Point(offset, 0.f), 2.f * M_PI);
+			}
+			else if (style.line_cap == LineCap::SQUARE) {
+				outline.points.push_back(p + Point(-offset, -offset));
+				outline.points.push_back(p + Point(offset, -offset));
+				outline.points.push_back(p + Point(offset, offset));
+				outline.points.push_back(p + Point(-offset, offset));
+			}
+			else {
+				return;
+			}
+			outline.closed = true;
+			outlines.push_back(outline);
+			return;
+		}
+		std::vector<Point> reversed(points.rbegin(), points.rend());
+		if (subpath.closed) {
+			Subpath outer;
+			add_side(outer, points, true);
+			outer.closed = true;
+			outlines.push_back(outer);
+			Subpath inner;
+			add_side(inner, reversed, true);
+			inner.closed = true;
+			outlines.push_back(inner);
+		}
+		else {
+			Subpath outline;
+			add_side(outline, points, false);
+			add_cap(outline, points.back(), direction(points[points.size()-2], points.back()));
+			add_side(outline, reversed, false);
+			add_cap(outline, points.front(), direction(points[1], points.front()));
+			outline.closed = true;
+			outlines.push_back(outline);
+		}
 	}
 };
 
 class Path {
 	Transformation t;
+	float tolerance;
+	float min_size;
+	float simplify_tolerance;
 	std::vector<Subpath> subpaths;
+	// the subpaths transformed to device space, computed once when the path is drawn for the first time
+	mutable std::vector<Subpath> device_subpaths;
+	mutable bool transformed = false;
+	const std::vector<Subpath>& get_device_subpaths() const {
+		if (!transformed) {
+			device_subpaths.clear();
+			for (const Subpath& subpath: subpaths) {
+				device_subpaths.push_back(transform(subpath));
+			}
+			transformed = true;
+		}
+		return device_subpaths;
+	}
+	Subpath transform(const Subpath& subpath) const {
+		Subpath result;
+		result.points.reserve(subpath.points.size() + 1);
+		for (const Point& p: subpath.points) {
+			result.points.push_back(t * p);
+		}
+		result.closed = subpath.closed;
+		return result;
+	}
 	Point current_point() const {
 		if (subpaths.empty()) {
 			return Point(0.f, 0.f);
@@ -93,35 +277,120 @@ class Path {
 			return subpath.points.back();
 		}
 	}
-	static constexpr float length_squared(const Point& p) {
-		return dot(p, p);
-	}
 	// returns the distance (squared) between p and the segment a-b
 	static float get_distance_squared(const Point& a, const Point& b, const Point& p) {
-		if (a == b) return length_squared(p - a);
-		const float u = dot(p - a, b - a) / length_squared(b - a);
-		if (u <= 0.f) return length_squared(p - a);
-		else if (u >= 1.f) return length_squared(p - b);
-		else return length_squared((p - a) - (b - a) * u);
-	}
-	static float get_error_squared(const Point& p0, const Point& p1, const Point& p2, const Point& p3) {
-		return std::max(get_distance_squared(p0, p3, p1), get_distance_squared(p0, p3, p2));
+		const Point d = b - a;
+		const float length_squared = dot(d, d);
+		const float u = length_squared > 0.f ? clamp(dot(p - a, d) / length_squared, 0.f, 1.f) : 0.f;
+		const Point e = p - a - d * u;
+		return dot(e, e);
+	}
+	// removes points that deviate less than the tolerance from the simplified polyline (Douglas-Peucker)
+	static void simplify(std::vector<Point>& points, float tolerance) {
+		if (points.size() < 3) {
+			return;
+		}
+		std::vector<bool> keep(points.size(), false);
+		keep.front() = true;
+		keep.back() = true;
+		std::vector<std::pair<size_t, size_t>> ranges;
+		ranges.emplace_back(0, points.size() - 1);
+		while (!ranges.empty()) {
+			const size_t first = ranges.back().first;
+			const size_t last = ranges.back().second;
+			ranges.pop_back();
+			float max_distance = tolerance * tolerance;
+			size_t index = first;
+			for (size_t i = first + 1; i < last; ++i) {
+				const float distance = get_distance_squared(points[first], points[last], points[i]);
+				if (distance > max_distance) {
+					max_distance = distance;
+					index = i;
+				}
+			}
+			if (index != first) {
+				keep[index] = true;
+				ranges.emplace_back(first, index);
+				ranges.emplace_back(index, last);
+			}
+		}
+		size_t n = 0;
+		for (size_t i = 0; i < points.size(); ++i) {
+			if (keep[i]) {
+				points[n++] = points[i];
+			}
+		}
+		points.erase(points.begin() + n, points.end());
 	}
 	static float angle(const Point& p) {
 		const float length = std::sqrt(p.x * p.x + p.y * p.y);
 		const float a = std::acos(p.x / length);
 		return p.y < 0.f ? -a : a;
 	}
-	void fill_subpath(const Subpath& subpath, Shape& shape) const {
-		const std::vector<Point>& points = subpath.points;
+	void stroke_hairline(const Subpath& subpath, const StrokeStyle& style, float width, Shape& shape) const {
+		std::vector<Point> points;
+		for (const Point& p: subpath.points) {
+			if (points.empty() || !(points.back() == p)) {
+				points.push_back(p);
+			}
+		}
+		if (subpath.closed && points.size() > 1) {
+			points.push_back(points.front());
+		}
+		if (simplify_tolerance > 0.f) {
+			simplify(points, simplify_tolerance);
+		}
+		if (points.size() < 2) {
+			return;
+		}
+		if (min_size > 0.f) {
+			Rectangle bounds;
+			for (const Point& p: points) {
+				bounds = bounds | p;
+			}
+			if (bounds.x1 - bounds.x0 < min_size && bounds.y1 - bounds.y0 < min_size) {
+				return;
+			}
+		}
+		if (!subpath.closed && style.line_cap != LineCap::BUTT) {
+			// approximate round and square caps by extending the ends
+			const size_t n = points.size();
+			const Point d0 = points[0] - points[1];
+			const Point d1 = points[n-1] - points[n-2];
+			points[0] = points[0] + d0 * (width / 2.f / std::sqrt(dot(d0, d0)));
+			points[n-1] = points[n-1] + d1 * (width / 2.f / std::sqrt(dot(d1, d1)));
+		}
 		for (size_t i = 1; i < points.size(); ++i) {
-			shape.append_segment(t * points[i-1], t * points[i]);
+			shape.append_hairline(points[i-1], points[i], width);
 		}
-		shape.append_segment(t * points.back(), t * points.front());
+	}
+	// fills a subpath that is already in device space
+	void fill_subpath(Subpath subpath, std::vector<Shape>& shapes, SegmentStore& segments) const {
+		std::vector<Point>& points = subpath.points;
+		if (min_size > 0.f) {
+			Rectangle bounds;
+			for (const Point& p: points) {
+				bounds = bounds | p;
+			}
+			if (bounds.x1 - bounds.x0 < min_size && bounds.y1 - bounds.y0 < min_size) {
+				return;
+			}
+		}
+		if (simplify_tolerance > 0.f) {
+			points.push_back(points.front());
+			simplify(points, simplify_tolerance);
+		}
+		Shape& shape = shapes.back();
+		const std::uint32_t index = shapes.size() - 1;
+		for (size_t i = 1; i < points.size(); ++i) {
+			shape.append_segment(segments, index, points[i-1], points[i]);
+		}
+		shape.append_segment(segments, index, points.back(), points.front());
 	}
 public:
-	Path(const Transformation& t = Transformation()): t(t) {}
+	Path(const Transformation& t = Transformation(), const RenderOptions& options = RenderOptions()): t(t), tolerance(options.tolerance), min_size(options.min_size), simplify_tolerance(options.simplify) {}
 	void move_to(const Point& p) {
+		transformed = false;
 		subpaths.push_back(Subpath());
 		subpaths.back().points.push_back(p);
 	}
@@ -132,27 +401,37 @@ public:
 		if (subpaths.empty() || subpaths.back().closed) {
 			move_to(current_point());
 		}
+		transformed = false;
 		subpaths.back().points.push_back(p);
 	}
 	void line_to(float x, float y) {
 		line_to(Point(x, y));
 	}
 	void curve_to(const Point& p1, const Point& p2, const Point& p3) {
-		const Point& p0 = current_point();
-		constexpr float tolerance = .1f;
-		if (get_error_squared(t * p0, t * p1, t * p2, t * p3) < tolerance * tolerance) {
-			line_to(p3);
-		}
-		else {
-			const Point p4 = (p0 + p1) * .5f;
-			const Point p5 = (p1 + p2) * .5f;
-			const Point p6 = (p2 + p3) * .5f;
-			const Point p7 = (p4 + p5) * .5f;
-			const Point p8 = (p5 + p6) * .5f;
-			const Point p9 = (p7 + p8) * .5f;
-			curve_to(p4, p7, p9);
-			curve_to(p8, p6, p3);
+		const Point p0 = current_point();
+		// estimate the number of segments using Wang's formula in device space, the second differences are vectors and only need the linear part of the transformation
+		const Point u0 = p0 - p1 * 2.f + p2;
+		const Point u1 = p1 - p2 * 2.f + p3;
+		const Point d0(t.a * u0.x + t.c * u0.y, t.b * u0.x + t.d * u0.y);
+		const Point d1(t.a * u1.x + t.c * u1.y, t.b * u1.x + t.d * u1.y);
+		const float m = std::sqrt(std::max(dot(d0, d0), dot(d1, d1)));
+		const int n = clamp(std::ceil(std::sqrt(.75f * m / tolerance)), 1.f, 1000.f);
+		// evaluate the curve using forward differencing
+		const float h = 1.f / n;
+		const Point a = (p1 - p2) * 3.f + p3 - p0;
+		const Point b = (p0 - p1 * 2.f + p2) * 3.f;
+		const Point c = (p1 - p0) * 3.f;
+		Point f = p0;
+		Point df = a * (h * h * h) + b * (h * h) + c * h;
+		Point ddf = a * (6.f * h * h * h) + b * (2.f * h * h);
+		const Point dddf = a * (6.f * h * h * h);
+		for (int i = 1; i < n; ++i) {
+			f = f + df;
+			df = df + ddf;
+			ddf = ddf + dddf;
+			line_to(f);
 		}
+		line_to(p3);
 	}
 	void quadratic_curve_to(const Point& p1, const Point& p2) {
 		const Point& p0 = current_point();
@@ -206,37 +485,50 @@ public:
 		add_arc(Point(0.f, 0.f), 1.f, start_angle, sweep_angle, t);
 	}
 	void close() {
+		transformed = false;
 		subpaths.back().closed = true;
 	}
-	void fill(std::vector<Shape>& shapes, const std::shared_ptr<Paint>& paint) const {
-		shapes.emplace_back(paint);
-		Shape& shape = shapes.back();
-		for (const Subpath& subpath: subpaths) {
-			fill_subpath(subpath, shape);
+	void fill(std::vector<Shape>& shapes, SegmentStore& segments, const std::shared_ptr<Paint>& paint) const {
+		shapes.emplace_back(paint, segments.size());
+		for (const Subpath& subpath: get_device_subpaths()) {
+			fill_subpath(subpath, shapes, segments);
 		}
 	}
-	void stroke(std::vector<Shape>& shapes, float width, const std::shared_ptr<Paint>& paint) const {
-		shapes.emplace_back(paint);
+	void stroke(std::vector<Shape>& shapes, SegmentStore& segments, const StrokeStyle& style, const std::shared_ptr<Paint>& paint) const {
+		shapes.emplace_back(paint, segments.size());
 		Shape& shape = shapes.back();
-		const float offset = width / 2.f;
-		for (const Subpath& subpath: subpaths) {
-			const std::vector<Point>& points = subpath.points;
-			Subpath new_subpath;
-			for (size_t i = 1; i < points.size(); ++i) {
-				new_subpath.push_offset_segment(points[i-1], points[i], offset);
+		// choose the angle step of round joins and caps based on the radius in device space
+		const float scale = std::sqrt(std::max(t.a * t.a + t.b * t.b, t.c * t.c + t.d * t.d));
+		if (style.width * scale <= 1.f) {
+			// strokes up to one pixel wide are drawn directly instead of computing their outline
+			for (const Subpath& subpath: get_device_subpaths()) {
+				stroke_hairline(subpath, style, style.width * scale, shape);
 			}
-			if (subpath.closed) {
-				new_subpath.push_offset_segment(points.back(), points.front(), offset);
-				new_subpath.closed = true;
-				fill_subpath(new_subpath, shape);
-				new_subpath = Subpath();
-				new_subpath.push_offset_segment(points.front(), points.back(), offset);
+			return;
+		}
+		const float cos_step = 1.f - tolerance / (style.width / 2.f * scale);
+		const float angle_step = cos_step > -1.f ? 2.f * std::acos(cos_step) : M_PI;
+		std::vector<Subpath> outlines;
+		if (t.is_conformal()) {
+			// circles stay circles, so the outline can be computed in device space
+			Stroker stroker(StrokeStyle(style.width * scale, style.line_join, style.line_cap, style.miter_limit), angle_step);
+			for (const Subpath& subpath: get_device_subpaths()) {
+				outlines.clear();
+				stroker.stroke(subpath, outlines);
+				for (const Subpath& outline: outlines) {
+					fill_subpath(outline, shapes, segments);
+				}
 			}
-			for (size_t i = points.size() - 1; i > 0; --i) {
-				new_subpath.push_offset_segment(points[i], points[i-1], offset);
+		}
+		else {
+			Stroker stroker(style, angle_step);
+			for (const Subpath& subpath: subpaths) {
+				outlines.clear();
+				stroker.stroke(subpath, outlines);
+				for (const Subpath& outline: outlines) {
+					fill_subpath(transform(outline), shapes, segments);
+				}
 			}
-			new_subpath.closed = true;
-			fill_subpath(new_subpath, shape);
 		}
 	}
 };
@@ -247,6 +539,11 @@ struct ColorPaint: Paint {
 	Color evaluate(const Point& point) override {
 		return color;
 	}
+	bool compile(PaintTable&, CompiledPaint& paint) const override {
+		paint.type = CompiledPaint::Type::COLOR;
+		paint.color = color;
+		return true;
+	}
 };
 
 struct Gradient {
@@ -276,6 +573,14 @@ struct Gradient {
 		const float factor = (pos - i0->pos) / (i->pos - i0->pos);
 		return i0->color * (1.f - factor) + i->color * factor;
 	}
+	// appends the lookup table of the gradient and returns its position
+	std::uint32_t compile(PaintTable& table) const {
+		const std::uint32_t lut = table.luts.size();
+		for (size_t i = 0; i < PaintTable::LUT_SIZE; ++i) {
+			table.luts.push_back(evaluate(static_cast<float>(i) / (PaintTable::LUT_SIZE - 1)));
+		}
+		return lut;
+	}
 };
 
 struct LinearGradient: Gradient {
@@ -338,6 +643,13 @@ struct LinearGradientPaint: Paint {
 	Color evaluate(const Point& point) override {
 		return gradient.evaluate(point);
 	}
+	bool compile(PaintTable& table, CompiledPaint& paint) const override {
+		paint.type = CompiledPaint::Type::LINEAR_GRADIENT;
+		paint.lut = gradient.Gradient::compile(table);
+		const float parameters[] = {gradient.start.x, gradient.start.y, gradient.end.x, gradient.end.y, 0.f, 0.f};
+		std::copy(parameters, parameters + 6, paint.parameters);
+		return true;
+	}
 };
 
 struct RadialGradientPaint: Paint {
@@ -346,6 +658,13 @@ struct RadialGradientPaint: Paint {
 	Color evaluate(const Point& p) override {
 		return gradient.evaluate(p);
 	}
+	bool compile(PaintTable& table, CompiledPaint& paint) const override {
+		paint.type = CompiledPaint::Type::RADIAL_GRADIENT;
+		paint.lut = gradient.Gradient::compile(table);
+		const float parameters[] = {gradient.c.x, gradient.c.y, gradient.r, gradient.f.x, gradient.f.y, gradient.fr};
+		std::copy(parameters, parameters + 6, paint.parameters);
+		return true;
+	}
 };
 
 struct OpacityPaint: Paint {
@@ -355,6 +674,13 @@ struct OpacityPaint: Paint {
 	Color evaluate(const Point& point) override {
 		return paint->evaluate(point) * opacity;
 	}
+	bool compile(PaintTable& table, CompiledPaint& paint) const override {
+		if (!this->paint->compile(table, paint)) {
+			return false;
+		}
+		paint.opacity *= opacity;
+		return true;
+	}
 };
 
 struct TransformationPaint: Paint {
@@ -364,6 +690,16 @@ struct TransformationPaint: Paint {
 	Color evaluate(const Point& point) override {
 		return paint->evaluate(transformation * point);
 	}
+	bool compile(PaintTable& table, CompiledPaint& paint) const override {
+		if (!this->paint->compile(table, paint)) {
+			return false;
+		}
+		const float* m = paint.matrix;
+		const Transformation t = Transformation(m[0], m[1], m[2], m[3], m[4], m[5]) * transformation;
+		const float matrix[] = {t.a, t.b, t.c, t.d, t.e, t.f};
+		std::copy(matrix, matrix + 6, paint.matrix);
+		return true;
+	}
 };
 
 struct PaintServer {
@@ -400,6 +736,9 @@ struct Style {
 	std::shared_ptr<PaintServer> stroke;
 	float stroke_width = 1.f;
 	float stroke_opacity = 1.f;
+	LineJoin stroke_linejoin = LineJoin::MITER;
+	LineCap stroke_linecap = LineCap::BUTT;
+	float stroke_miterlimit = 4.f;
 	std::shared_ptr<Paint> get_fill_paint(const Transformation& transformation = Transformation()) const {
 		return std::make_shared<OpacityPaint>(fill->get_paint(transformation), fill_opacity);
 	}
@@ -408,22 +747,130 @@ struct Style {
 	}
 };
 
-struct Document {
-	std::vector<Shape> shapes;
+struct Document: Scene {
 	float width = 0.f;
 	float height = 0.f;
 	void fill(const Path& path, const std::shared_ptr<Paint>& paint) {
-		path.fill(shapes, paint);
+		RASTER_TIME(FLATTEN);
+		path.fill(shapes, segments, paint);
 	}
-	void stroke(const Path& path, const std::shared_ptr<Paint>& paint, float width) {
-		path.stroke(shapes, width, paint);
+	void stroke(const Path& path, const std::shared_ptr<Paint>& paint, const StrokeStyle& style) {
+		RASTER_TIME(FLATTEN);
+		path.stroke(shapes, segments, style, paint);
 	}
 	void draw(const Path& path, const Style& style, const Transformation& transformation = Transformation()) {
 		if (style.fill && style.fill_opacity > 0.f) {
 			fill(path, style.get_fill_paint(transformation));
 		}
 		if (style.stroke && style.stroke_width > 0.f && style.stroke_opacity > 0.f) {
-			stroke(path, style.get_stroke_paint(transformation), style.stroke_width);
+			stroke(path, style.get_stroke_paint(transformation), StrokeStyle(style.stroke_width, style.stroke_linejoin, style.stroke_linecap, style.stroke_miterlimit));
 		}
 	}
+	// returns a copy moved by the offset in output pixels, the flattened geometry is reused instead of parsing again
+	Document translate(const Point& offset) const {
+		Document document;
+		document.width = width;
+		document.height = height;
+		const SegmentView segments = get_segments();
+		for (size_t i = 0; i < segments.size; ++i) {
+			const Line line = segments.get_line(i);
+			document.segments.append(segments.y0[i] + offset.y, segments.y1[i] + offset.y, Line(line.m, line.x0 + offset.x - line.m * offset.y), segments.shape[i], segments.direction[i]);
+		}
+		std::map<const Paint*, std::shared_ptr<Paint>> paints;
+		document.shapes.reserve(shapes.size());
+		for (const Shape& shape: shapes) {
+			document.shapes.push_back(shape);
+			Shape& copy = document.shapes.back();
+			std::shared_ptr<Paint>& paint = paints[shape.paint.get()];
+			if (!paint) {
+				paint = std::make_shared<TransformationPaint>(shape.paint, Transformation::translate(-offset.x, -offset.y));
+			}
+			copy.paint = paint;
+			for (Hairline& hairline: copy.hairlines) {
+				hairline.p0 = hairline.p0 + offset;
+				hairline.p1 = hairline.p1 + offset;
+			}
+			copy.bounds = Rectangle(shape.bounds.x0 + offset.x, shape.bounds.y0 + offset.y, shape.bounds.x1 + offset.x, shape.bounds.y1 + offset.y);
+		}
+		document.finish();
+		return document;
+	}
+	// returns a copy scaled down for a quick preview, the flattened geometry is reused: shapes smaller than min_size are
+	// dropped and consecutive segments are merged as long as the dropped points are within the tolerance of the merged
+	// segment, both in the scaled pixels
+	Document preview(float scale, float tolerance, float min_size) const {
+		Document document;
+		document.width = width * scale;
+		document.height = height * scale;
+		const SegmentView segments = get_segments();
+		std::map<const Paint*, std::shared_ptr<Paint>> paints;
+		std::vector<Point> chain;
+		for (const Shape& shape: shapes) {
+			if ((shape.bounds.x1 - shape.bounds.x0) * scale < min_size && (shape.bounds.y1 - shape.bounds.y0) * scale < min_size) {
+				continue;
+			}
+			std::shared_ptr<Paint>& paint = paints[shape.paint.get()];
+			if (!paint) {
+				paint = std::make_shared<TransformationPaint>(shape.paint, Transformation::scale(1.f / scale, 1.f / scale));
+			}
+			const std::uint32_t index = document.shapes.size();
+			document.shapes.emplace_back(paint, document.segments.size());
+			Shape& copy = document.shapes.back();
+			auto flush = [&]() {
+				if (chain.size() > 1) {
+					copy.append_segment(document.segments, index, chain.front(), chain.back());
+				}
+				chain.clear();
+			};
+			auto is_within_tolerance = [&](const Point& p1) {
+				const Point& p0 = chain.front();
+				const Point d = p1 - p0;
+				const float length_squared = dot(d, d);
+				for (size_t i = 1; i < chain.size(); ++i) {
+					const float u = length_squared > 0.f ? clamp(dot(chain[i] - p0, d) / length_squared, 0.f, 1.f) : 0.f;
+					const Point e = chain[i] - p0 - d * u;
+					if (dot(e, e) > tolerance * tolerance) {
+						return false;
+					}
+				}
+				return true;
+			};
+			for (size_t i = shape.first_segment; i < shape.last_segment; ++i) {
+				const Line line = segments.get_line(i);
+				Point p0(line.get_x(segments.y0[i]) * scale, segments.y0[i] * scale);
+				Point p1(line.get_x(segments.y1[i]) * scale, segments.y1[i] * scale);
+				if (segments.direction[i] < 0) {
+					std::swap(p0, p1);
+				}
+				if (!chain.empty() && (std::abs(chain.back().x - p0.x) > tolerance || std::abs(chain.back().y - p0.y) > tolerance)) {
+					// the segment starts a new subpath or follows a dropped horizontal segment
+					flush();
+				}
+				else if (chain.size() >= 32 || (!chain.empty() && !is_within_tolerance(p1))) {
+					const Point last = chain.back();
+					flush();
+					chain.push_back(last);
+				}
+				if (chain.empty()) {
+					chain.push_back(p0);
+				}
+				chain.push_back(p1);
+			}
+			flush();
+			for (const Hairline& hairline: shape.hairlines) {
+				copy.append_hairline(hairline.p0 * scale, hairline.p1 * scale, hairline.width * scale);
+			}
+		}
+		document.finish();
+		return document;
+	}
 };
+
+// renders a coarse preview of the document and then the full image, the callback receives each pixmap and whether it is
+// the final one. the scale of the preview options is relative to the document, their tolerance and min_size are in
+// preview pixels, the other options apply to the rendering of the preview
+template <class F> void render_progressive(Renderer& renderer, const Document& document, const RenderOptions& preview, const RenderOptions& options, F&& callback) {
+	const Document coarse = document.preview(preview.scale, preview.tolerance, preview.min_size);
+	callback(renderer.render(coarse, coarse.width, coarse.height, preview), false);
+	callback(renderer.render(document, document.width, document.height, options), true);
+}
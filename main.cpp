@@ -6,25 +6,550 @@ All rights reserved.
 */
 
 #include "parser.hpp"
+#include "scheduler.hpp"
+#include "png.hpp"
+#include "scene.hpp"
+#include "server.hpp"
 #include <string>
+#include <vector>
 #include <fstream>
 #include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <iomanip>
+#include <exception>
 
 std::string read_file(const char* file_name) {
-	std::ifstream file(file_name);
+	RASTER_TIME(READ);
+	std::ifstream file(file_name, std::ios::binary);
+	if (!file) {
+		throw std::string("could not open ") + file_name;
+	}
 	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
 }
 
+struct Job {
+	std::string input;
+	std::string output;
+};
+
+// reads pairs of input and output files separated by white space, one pair per line
+std::vector<Job> read_manifest(std::istream& stream) {
+	std::vector<Job> jobs;
+	std::string line;
+	while (std::getline(stream, line)) {
+		std::istringstream line_stream(line);
+		Job job;
+		if (!(line_stream >> job.input) || job.input[0] == '#') {
+			continue;
+		}
+		if (!(line_stream >> job.output)) {
+			throw std::string("missing output file for ") + job.input;
+		}
+		jobs.push_back(job);
+	}
+	return jobs;
+}
+
+// renders all jobs as tasks on the scheduler and returns the number of failures, the bands of one job are tasks as well
+size_t render_batch(const std::vector<Job>& jobs, Scheduler& scheduler, std::vector<Renderer>& renderers, const RenderOptions& options) {
+	std::atomic<size_t> failures(0);
+	std::mutex error_mutex;
+	parallel_for(scheduler, jobs.size(), [&](size_t i) {
+		RASTER_TRACE("job");
+		const Job& job = jobs[i];
+		try {
+			const std::string svg = read_file(job.input.c_str());
+			const Document document = parse(svg, options);
+			write_png(scheduler, renderers, document, document.width, document.height, options, job.output.c_str());
+		} catch (const std::string& error) {
+			++failures;
+			std::lock_guard<std::mutex> lock(error_mutex);
+			std::cerr << "error: " << job.input << ": " << error << std::endl;
+		} catch (const std::exception& error) {
+			++failures;
+			std::lock_guard<std::mutex> lock(error_mutex);
+			std::cerr << "error: " << job.input << ": " << error.what() << std::endl;
+		}
+	});
+	return failures;
+}
+
+struct Frame {
+	// applied in output pixels on top of the document's own transformations
+	Transformation transformation;
+	float opacity = 1.f;
+};
+
+// reads one frame per line: the six numbers a b c d e f of the transformation, optionally followed by the opacity
+std::vector<Frame> read_frames(std::istream& stream) {
+	std::vector<Frame> frames;
+	std::string line;
+	while (std::getline(stream, line)) {
+		std::istringstream line_stream(line);
+		std::string first;
+		if (!(line_stream >> first) || first[0] == '#') {
+			continue;
+		}
+		Frame frame;
+		Transformation& t = frame.transformation;
+		t.a = std::atof(first.c_str());
+		if (!(line_stream >> t.b >> t.c >> t.d >> t.e >> t.f)) {
+			throw std::string("invalid frame: ") + line;
+		}
+		line_stream >> frame.opacity;
+		frames.push_back(frame);
+	}
+	return frames;
+}
+
+// inserts the zero padded frame number before the extension of the output file
+std::string get_frame_file_name(const std::string& output, size_t frame, size_t frame_count) {
+	size_t position = output.find_last_of('.');
+	const size_t directory = output.find_last_of('/');
+	if (position == std::string::npos || (directory != std::string::npos && directory > position)) {
+		position = output.size();
+	}
+	size_t digits = 4;
+	for (size_t n = frame_count - 1; n >= 10000; n /= 10) {
+		++digits;
+	}
+	std::ostringstream name;
+	name << output.substr(0, position) << std::setw(digits) << std::setfill('0') << frame << output.substr(position);
+	return name.str();
+}
+
+// renders every frame to a numbered file and returns the number of failures. the document is parsed once for every
+// distinct linear part of the frame transformations, frames that only differ in their translation reuse the flattened
+// geometry of the first such frame. the frames of a document are rendered as soon as it is parsed
+size_t render_frames(const std::string& svg, const std::vector<Frame>& frames, const std::string& output, Scheduler& scheduler, std::vector<Renderer>& renderers, const RenderOptions& options) {
+	std::vector<size_t> bases;
+	std::vector<size_t> frame_bases(frames.size());
+	for (size_t i = 0; i < frames.size(); ++i) {
+		const Transformation& t = frames[i].transformation;
+		size_t j = 0;
+		while (j < bases.size()) {
+			const Transformation& base = frames[bases[j]].transformation;
+			if (t.a == base.a && t.b == base.b && t.c == base.c && t.d == base.d) {
+				break;
+			}
+			++j;
+		}
+		if (j == bases.size()) {
+			bases.push_back(i);
+		}
+		frame_bases[i] = j;
+	}
+	std::vector<Document> documents(bases.size());
+	std::atomic<size_t> failures(0);
+	std::mutex error_mutex;
+	auto report = [&](size_t frame, const std::string& error) {
+		++failures;
+		std::lock_guard<std::mutex> lock(error_mutex);
+		std::cerr << "error: frame " << frame << ": " << error << std::endl;
+	};
+	auto render_frame = [&](size_t i) {
+		RASTER_TRACE("frame");
+		const size_t base = frame_bases[i];
+		try {
+			const Transformation& t = frames[i].transformation;
+			const Transformation& base_transformation = frames[bases[base]].transformation;
+			const Point offset(t.e - base_transformation.e, t.f - base_transformation.f);
+			const Document& document = documents[base];
+			Renderer& renderer = renderers[scheduler.get_thread_index()];
+			Pixmap pixmap(document.width, document.height);
+			if (offset.x == 0.f && offset.y == 0.f) {
+				renderer.render(document, pixmap, Rectangle(0.f, 0.f, pixmap.get_width(), pixmap.get_height()), options);
+			}
+			else {
+				renderer.render(document.translate(offset), pixmap, Rectangle(0.f, 0.f, pixmap.get_width(), pixmap.get_height()), options);
+			}
+			if (frames[i].opacity != 1.f) {
+				pixmap.multiply(frames[i].opacity);
+			}
+			write_png(pixmap, get_frame_file_name(output, i, frames.size()).c_str());
+		} catch (const std::string& error) {
+			report(i, error);
+		} catch (const std::exception& error) {
+			report(i, error.what());
+		}
+	};
+	// a document that could not be parsed fails all of its frames
+	auto report_document = [&](size_t j, const std::string& error) {
+		for (size_t i = 0; i < frames.size(); ++i) {
+			if (frame_bases[i] == j) {
+				report(i, error);
+			}
+		}
+	};
+	TaskGroup group;
+	for (size_t j = 0; j < bases.size(); ++j) {
+		scheduler.submit(group, [&, j]() {
+			try {
+				documents[j] = parse(svg, frames[bases[j]].transformation, options);
+			} catch (const std::string& error) {
+				report_document(j, error);
+				return;
+			} catch (const std::exception& error) {
+				report_document(j, error.what());
+				return;
+			}
+			for (size_t i = 0; i < frames.size(); ++i) {
+				if (frame_bases[i] == j) {
+					scheduler.submit(group, [&, i]() {
+						render_frame(i);
+					});
+				}
+			}
+		});
+	}
+	scheduler.wait(group);
+	return failures;
+}
+
+// parses a number of bytes with an optional k, m or g suffix
+size_t parse_size(const char* s) {
+	char* end;
+	size_t size = std::strtoull(s, &end, 10);
+	// every step from k to m to g multiplies by another 1024
+	const char* suffixes = "kmg";
+	const char* suffix = *end ? std::strchr(suffixes, std::tolower(*end)) : nullptr;
+	if (suffix) {
+		size <<= 10 * (suffix - suffixes + 1);
+	}
+	return size;
+}
+
+void print_usage() {
+	std::cout << "usage: raster [options] <input> <output>" << std::endl;
+	std::cout << "       raster [options] --batch <manifest>" << std::endl;
+	std::cout << "       raster [options] --serve <socket>" << std::endl;
+	std::cout << "       raster [options] --client <socket> <input> <output>" << std::endl;
+	std::cout << "       raster [options] --frames <frames> <input> <output>" << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  --scale <factor>      scale the output" << std::endl;
+	std::cout << "  --tolerance <pixels>  curve flattening tolerance (default 0.1)" << std::endl;
+	std::cout << "  --min-size <pixels>   cull subpaths smaller than this" << std::endl;
+	std::cout << "  --simplify <pixels>   remove detail below this error" << std::endl;
+	std::cout << "  --fixed               use fixed point geometry" << std::endl;
+	std::cout << "  --time-limit <seconds>  abort renders that take longer" << std::endl;
+	std::cout << "  --max-segments <n>    refuse scenes with more segments" << std::endl;
+	std::cout << "  --max-events <n>      refuse renders with more sweep events" << std::endl;
+	std::cout << "  --max-strips <n>      abort renders with more strips" << std::endl;
+	std::cout << "  --preview <file>      write a coarse preview before rendering the output" << std::endl;
+	std::cout << "  --preview-scale <factor>  scale of the preview relative to the output (default 0.25)" << std::endl;
+	std::cout << "  --memory-budget <bytes>  render in bands that fit into this memory, k, m and g suffixes are allowed" << std::endl;
+	std::cout << "  --compile             write a compiled scene instead of an image" << std::endl;
+	std::cout << "  --compiled            read a compiled scene instead of an SVG file" << std::endl;
+	std::cout << "  --batch <manifest>    render the input and output pairs listed in the manifest (- for stdin)" << std::endl;
+	std::cout << "  -j <threads>          number of threads" << std::endl;
+	std::cout << "  --frames <frames>     render one numbered output per line of a, b, c, d, e, f and an optional opacity" << std::endl;
+	std::cout << "  --cache <documents>   number of parsed documents the server keeps (default 64)" << std::endl;
+	std::cout << "  --max-request <bytes>  longest document the server accepts (default 64m), k, m and g suffixes are allowed" << std::endl;
+	std::cout << "  --max-pixels <n>      most pixels of an image the server renders (default 268435456)" << std::endl;
+	std::cout << "  --viewport <x> <y> <width> <height>  region of the output the client requests" << std::endl;
+	std::cout << "  --format <png|rgba>   image format the client requests" << std::endl;
+	std::cout << "  --send-path           send the input path instead of its content to the server" << std::endl;
+	std::cout << "  --stats               print the time of every stage and the counters as JSON" << std::endl;
+	std::cout << "  --trace <file>        write the stages and bands of every thread as Chrome trace events" << std::endl;
+}
+
+// prints the statistics of everything since start to stdout
+void print_stats(std::chrono::steady_clock::time_point start) {
+#ifdef RASTER_STATS
+	const std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+	std::cout << stats::get_json(wall.count()) << std::endl;
+#else
+	(void)start;
+	std::cerr << "error: statistics are not available, build with RASTER_STATS" << std::endl;
+#endif
+}
+
+const char* trace_file = nullptr;
+
+void write_trace() {
+#ifdef RASTER_STATS
+	if (!stats::write_trace(trace_file)) {
+		std::cerr << "error: could not write " << trace_file << std::endl;
+	}
+#endif
+}
+
+// records the trace from now on and writes it when the program exits
+void start_tracing(const char* file_name) {
+#ifdef RASTER_STATS
+	trace_file = file_name;
+	stats::start_tracing();
+	std::atexit(write_trace);
+#else
+	(void)file_name;
+	std::cerr << "error: tracing is not available, build with RASTER_STATS" << std::endl;
+#endif
+}
+
 int main(int argc, char** argv) {
-	if (argc <= 2) {
-		std::cout << "usage: raster <input> <output>" << std::endl;
+	const auto start = std::chrono::steady_clock::now();
+	RenderOptions options;
+	std::vector<const char*> files;
+	const char* manifest = nullptr;
+	const char* frame_list = nullptr;
+	const char* server_socket = nullptr;
+	const char* client_socket = nullptr;
+	size_t cache_size = 64;
+	ServerLimits limits;
+	RenderRequest request;
+	const char* preview_file = nullptr;
+	float preview_scale = .25f;
+	bool compile = false;
+	bool compiled = false;
+	bool print_statistics = false;
+	size_t thread_count = std::max(std::thread::hardware_concurrency(), 1u);
+	for (int i = 1; i < argc; ++i) {
+		const std::string argument = argv[i];
+		if (argument == "--scale" && i + 1 < argc) {
+			options.scale = std::atof(argv[++i]);
+		}
+		else if (argument == "--tolerance" && i + 1 < argc) {
+			options.tolerance = std::atof(argv[++i]);
+		}
+		else if (argument == "--min-size" && i + 1 < argc) {
+			options.min_size = std::atof(argv[++i]);
+		}
+		else if (argument == "--simplify" && i + 1 < argc) {
+			options.simplify = std::atof(argv[++i]);
+		}
+		else if (argument == "--fixed") {
+			options.fixed_point = true;
+		}
+		else if (argument == "--time-limit" && i + 1 < argc) {
+			options.time_limit = std::atof(argv[++i]);
+		}
+		else if (argument == "--max-segments" && i + 1 < argc) {
+			options.max_segments = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (argument == "--max-events" && i + 1 < argc) {
+			options.max_events = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (argument == "--max-strips" && i + 1 < argc) {
+			options.max_strips = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (argument == "--preview" && i + 1 < argc) {
+			preview_file = argv[++i];
+		}
+		else if (argument == "--preview-scale" && i + 1 < argc) {
+			preview_scale = std::atof(argv[++i]);
+		}
+		else if (argument == "--memory-budget" && i + 1 < argc) {
+			options.memory_budget = parse_size(argv[++i]);
+		}
+		else if (argument == "--compile") {
+			compile = true;
+		}
+		else if (argument == "--compiled") {
+			compiled = true;
+		}
+		else if (argument == "--batch" && i + 1 < argc) {
+			manifest = argv[++i];
+		}
+		else if (argument == "--frames" && i + 1 < argc) {
+			frame_list = argv[++i];
+		}
+		else if (argument == "-j" && i + 1 < argc) {
+			thread_count = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (argument == "--serve" && i + 1 < argc) {
+			server_socket = argv[++i];
+		}
+		else if (argument == "--cache" && i + 1 < argc) {
+			cache_size = std::max(std::atoi(argv[++i]), 1);
+		}
+		else if (argument == "--max-request" && i + 1 < argc) {
+			limits.max_request_size = parse_size(argv[++i]);
+		}
+		else if (argument == "--max-pixels" && i + 1 < argc) {
+			limits.max_pixels = std::strtoull(argv[++i], nullptr, 10);
+		}
+		else if (argument == "--client" && i + 1 < argc) {
+			client_socket = argv[++i];
+		}
+		else if (argument == "--viewport" && i + 4 < argc) {
+			request.x = std::atof(argv[++i]);
+			request.y = std::atof(argv[++i]);
+			request.width = std::atof(argv[++i]);
+			request.height = std::atof(argv[++i]);
+		}
+		else if (argument == "--format" && i + 1 < argc) {
+			request.format = argv[++i];
+		}
+		else if (argument == "--send-path") {
+			request.is_path = true;
+		}
+		else if (argument == "--stats") {
+			print_statistics = true;
+		}
+		else if (argument == "--trace" && i + 1 < argc) {
+			start_tracing(argv[++i]);
+		}
+		else {
+			files.push_back(argv[i]);
+		}
+	}
+	if (!(options.tolerance > 0.f)) {
+		std::cerr << "error: --tolerance must be positive" << std::endl;
+		return 1;
+	}
+	if (!(options.min_size >= 0.f)) {
+		std::cerr << "error: --min-size must not be negative" << std::endl;
+		return 1;
+	}
+	if (server_socket) {
+		try {
+			serve(server_socket, cache_size, thread_count, options, limits);
+		} catch (const std::string& error) {
+			std::cerr << "error: " << error << std::endl;
+			return 1;
+		} catch (const std::exception& error) {
+			std::cerr << "error: " << error.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (client_socket) {
+		if (files.size() < 2) {
+			print_usage();
+			return 0;
+		}
+		try {
+			// the scale is applied by the server on top of its own options
+			request.scale = options.scale;
+			request.source = request.is_path ? files[0] : read_file(files[0]);
+			const std::string image = send_request(client_socket, request);
+			std::ofstream file(files[1], std::ios::binary);
+			if (!file) {
+				throw std::string("could not open ") + files[1];
+			}
+			file << image;
+		} catch (const std::string& error) {
+			std::cerr << "error: " << error << std::endl;
+			return 1;
+		} catch (const std::exception& error) {
+			std::cerr << "error: " << error.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (manifest) {
+		try {
+			std::vector<Job> jobs;
+			if (std::string(manifest) == "-") {
+				jobs = read_manifest(std::cin);
+			}
+			else {
+				std::ifstream file(manifest);
+				if (!file) {
+					throw std::string("could not open ") + manifest;
+				}
+				jobs = read_manifest(file);
+			}
+			Scheduler scheduler(thread_count);
+			std::vector<Renderer> renderers(scheduler.get_thread_count());
+			const size_t failures = render_batch(jobs, scheduler, renderers, options);
+			if (failures > 0) {
+				std::cerr << failures << " of " << jobs.size() << " files failed" << std::endl;
+			}
+			if (print_statistics) {
+				print_stats(start);
+			}
+			if (failures > 0) {
+				return 1;
+			}
+		} catch (const std::string& error) {
+			std::cerr << "error: " << error << std::endl;
+			return 1;
+		} catch (const std::exception& error) {
+			std::cerr << "error: " << error.what() << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+	if (files.size() < 2) {
+		print_usage();
+		return 0;
+	}
+	if (frame_list) {
+		try {
+			std::ifstream file(frame_list);
+			if (!file) {
+				throw std::string("could not open ") + frame_list;
+			}
+			const std::vector<Frame> frames = read_frames(file);
+			Scheduler scheduler(thread_count);
+			std::vector<Renderer> renderers(scheduler.get_thread_count());
+			const size_t failures = render_frames(read_file(files[0]), frames, files[1], scheduler, renderers, options);
+			if (failures > 0) {
+				std::cerr << failures << " of " << frames.size() << " frames failed" << std::endl;
+			}
+			if (print_statistics) {
+				print_stats(start);
+			}
+			if (failures > 0) {
+				return 1;
+			}
+		} catch (const std::string& error) {
+			std::cerr << "error: " << error << std::endl;
+			return 1;
+		} catch (const std::exception& error) {
+			std::cerr << "error: " << error.what() << std::endl;
+			return 1;
+		}
 		return 0;
 	}
-	std::string svg = read_file(argv[1]);
+	// the preview and the output share the time limit
+	options = start_time_limit(options);
 	try {
-		Document document = parse(svg);
-		rasterize(document.shapes, argv[2], document.width, document.height);
+		// compiled scenes are already flattened, only the rasterizer options apply to them
+		Document document = compiled ? read_scene(files[0]) : parse(read_file(files[0]), options);
+		if (compile) {
+			write_scene(document, files[1]);
+		}
+		else if (preview_file) {
+			const char* output = files[1];
+			// the preview is flattened coarser and skips shapes smaller than a preview pixel
+			RenderOptions preview = options;
+			preview.scale = preview_scale;
+			preview.tolerance = .5f;
+			preview.min_size = 1.f;
+			Renderer renderer;
+			render_progressive(renderer, document, preview, options, [&](const Pixmap& pixmap, bool final) {
+				write_png(pixmap, final ? output : preview_file);
+			});
+		}
+		else {
+			Scheduler scheduler(thread_count);
+			std::vector<Renderer> renderers(scheduler.get_thread_count());
+			write_png(scheduler, renderers, document, document.width, document.height, options, files[1]);
+			if (options.memory_budget > 0) {
+				// the renderers run at the same time, so their peaks add up
+				size_t peak_memory_usage = 0;
+				for (const Renderer& renderer: renderers) {
+					peak_memory_usage += renderer.get_peak_memory_usage();
+				}
+				std::cerr << "peak memory " << peak_memory_usage << " bytes on " << renderers.size() << " threads" << std::endl;
+			}
+		}
+		if (print_statistics) {
+			print_stats(start);
+		}
 	} catch (const std::string& error) {
 		std::cerr << "error: " << error << std::endl;
+		return 1;
+	} catch (const std::exception& error) {
+		std::cerr << "error: " << error.what() << std::endl;
+		return 1;
 	}
 }
@@ -7,6 +7,7 @@ All rights reserved.
 
 #include "parser.hpp"
 #include <map>
+#include <set>
 #include <memory>
 
 class Parser {
@@ -122,11 +123,25 @@ class XMLNode {
 	StringView name;
 	std::map<StringView, StringView> attributes;
 	std::vector<std::unique_ptr<XMLNode>> children;
+	std::vector<StringView> text;
+	StringView start_tag;
+	StringView source;
 public:
 	XMLNode(const StringView& name): name(name) {}
 	const StringView& get_name() const {
 		return name;
 	}
+	void set_source(const StringView& start_tag, const StringView& source) {
+		this->start_tag = start_tag;
+		this->source = source;
+	}
+	const StringView& get_start_tag() const {
+		return start_tag;
+	}
+	// the text of the whole element including its start and end tags
+	const StringView& get_source() const {
+		return source;
+	}
 	void set_attribute(const StringView& name, const StringView& value) {
 		attributes[name] = value;
 	}
@@ -140,6 +155,12 @@ public:
 	std::vector<std::unique_ptr<XMLNode>>& get_children() {
 		return children;
 	}
+	void add_text(const StringView& text) {
+		this->text.push_back(text);
+	}
+	const std::vector<StringView>& get_text() const {
+		return text;
+	}
 };
 
 class XMLParser: public Parser {
@@ -253,6 +274,19 @@ class XMLParser: public Parser {
 			if (!parse(any_char)) error("unexpected end");
 		}
 	}
+	bool next_is_cdata() const {
+		return copy().parse("<![CDATA[");
+	}
+	StringView parse_cdata() {
+		expect("<![CDATA[");
+		StringView start = get();
+		StringView end = get();
+		while (!parse("]]>")) {
+			if (!parse(any_char)) error("unexpected end");
+			end = get();
+		}
+		return end - start;
+	}
 	StringView parse_char_data() {
 		StringView start = get();
 		parse_all([](Character c) {
@@ -261,15 +295,20 @@ class XMLParser: public Parser {
 		return get() - start;
 	}
 	std::unique_ptr<XMLNode> parse_node() {
+		StringView start = get();
 		StringView name = parse_start_tag();
 		std::unique_ptr<XMLNode> node(new XMLNode(name));
 		parse_attributes(node);
+		StringView start_tag = get() - start;
 		while (!next_is_end_tag()) {
+			if (!has_next()) error("unexpected end");
 			if (next_is_comment()) parse_comment();
+			else if (next_is_cdata()) node->add_text(parse_cdata());
 			else if (next_is_start_tag()) node->add_child(parse_node());
-			else parse_char_data();
+			else node->add_text(parse_char_data());
 		}
 		parse_end_tag(name);
+		node->set_source(start_tag, get() - start);
 		return node;
 	}
 public:
@@ -769,6 +808,217 @@ public:
 	}
 };
 
+class StyleSheet {
+public:
+	struct Selector {
+		StringView name;
+		StringView id;
+		std::vector<StringView> classes;
+		int get_specificity() const {
+			return (id ? 10000 : 0) + classes.size() * 100 + (name ? 1 : 0);
+		}
+		bool matches(const std::unique_ptr<XMLNode>& node, const std::vector<StringView>& node_classes) const {
+			if (name && name != node->get_name()) return false;
+			if (id && id != node->get_attribute("id")) return false;
+			for (const StringView& c: classes) {
+				if (std::find(node_classes.begin(), node_classes.end(), c) == node_classes.end()) return false;
+			}
+			return true;
+		}
+	};
+private:
+	struct Rule {
+		Selector selector;
+		StringView declarations;
+		int specificity;
+		Rule(const Selector& selector, const StringView& declarations): selector(selector), declarations(declarations), specificity(selector.get_specificity()) {}
+	};
+	using RuleIndex = std::map<StringView, std::vector<size_t>>;
+	std::vector<Rule> rules;
+	// every rule is indexed under its most selective key only
+	RuleIndex id_rules;
+	RuleIndex class_rules;
+	RuleIndex name_rules;
+	std::vector<size_t> universal_rules;
+	static void collect(const RuleIndex& index, const StringView& key, std::vector<size_t>& result) {
+		auto i = index.find(key);
+		if (i != index.end()) {
+			result.insert(result.end(), i->second.begin(), i->second.end());
+		}
+	}
+	static std::vector<StringView> get_classes(const std::unique_ptr<XMLNode>& node) {
+		std::vector<StringView> classes;
+		Parser p(node->get_attribute("class"));
+		p.parse_all(Parser::white_space);
+		while (p.has_next()) {
+			StringView start = p.get();
+			p.parse_all([](Character c) {
+				return !Parser::white_space(c);
+			});
+			classes.push_back(p.get() - start);
+			p.parse_all(Parser::white_space);
+		}
+		return classes;
+	}
+public:
+	void add_rule(const Selector& selector, const StringView& declarations) {
+		const size_t index = rules.size();
+		rules.emplace_back(selector, declarations);
+		if (selector.id) id_rules[selector.id].push_back(index);
+		else if (!selector.classes.empty()) class_rules[selector.classes.front()].push_back(index);
+		else if (selector.name) name_rules[selector.name].push_back(index);
+		else universal_rules.push_back(index);
+	}
+	// sets the declarations of all matching rules as attributes of the node, in cascade order
+	void apply(std::unique_ptr<XMLNode>& node) const {
+		if (rules.empty()) {
+			return;
+		}
+		const std::vector<StringView> classes = get_classes(node);
+		std::vector<size_t> candidates = universal_rules;
+		if (StringView id = node->get_attribute("id")) {
+			collect(id_rules, id, candidates);
+		}
+		for (const StringView& c: classes) {
+			collect(class_rules, c, candidates);
+		}
+		collect(name_rules, node->get_name(), candidates);
+		if (candidates.empty()) {
+			return;
+		}
+		// a class may be listed twice in the class attribute
+		std::sort(candidates.begin(), candidates.end());
+		candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+		candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [&](size_t i) {
+			return !rules[i].selector.matches(node, classes);
+		}), candidates.end());
+		std::stable_sort(candidates.begin(), candidates.end(), [&](size_t i0, size_t i1) {
+			return rules[i0].specificity < rules[i1].specificity;
+		});
+		for (size_t i: candidates) {
+			StyleParser p(rules[i].declarations);
+			p.parse_style(node);
+		}
+	}
+};
+
+class StyleSheetParser: public Parser {
+	StyleSheet& style_sheet;
+	using Parser::parse;
+	static constexpr bool identifier_char(Character c) {
+		return c.between('a', 'z') || c.between('A', 'Z') || c.between('0', '9') || c == '-' || c == '_';
+	}
+	void skip_white_space_and_comments() {
+		while (true) {
+			if (parse("/*")) {
+				while (!parse("*/")) {
+					if (!parse(any_char)) return;
+				}
+			}
+			else if (!parse(white_space)) {
+				break;
+			}
+		}
+	}
+	StringView parse_identifier() {
+		StringView start = get();
+		if (!parse(identifier_char)) error("expected an identifier");
+		parse_all(identifier_char);
+		return get() - start;
+	}
+	StringView parse_until(Character end) {
+		StringView start = get();
+		parse_all([end](Character c) {
+			return c != end;
+		});
+		return get() - start;
+	}
+	void skip_block() {
+		int depth = 0;
+		while (has_next()) {
+			const Character c = next();
+			if (c == '{') {
+				++depth;
+			}
+			else if (c == '}' && --depth <= 0) {
+				break;
+			}
+		}
+	}
+	static constexpr bool selector_end(Character c) {
+		return c == ',' || c == '{' || c == '}';
+	}
+	// only compound selectors are supported, selectors with combinators,
+	// pseudo-classes or attributes are skipped
+	bool parse_selector(StyleSheet::Selector& selector) {
+		parse_all(white_space);
+		// the universal selector matches every name, just like no name
+		parse('*');
+		if (copy().parse(identifier_char)) {
+			selector.name = parse_identifier();
+		}
+		while (true) {
+			if (parse('#') && copy().parse(identifier_char)) {
+				selector.id = parse_identifier();
+			}
+			else if (parse('.') && copy().parse(identifier_char)) {
+				selector.classes.push_back(parse_identifier());
+			}
+			else {
+				break;
+			}
+		}
+		parse_all(white_space);
+		if (copy().parse(selector_end)) {
+			return true;
+		}
+		parse_all([](Character c) {
+			return !selector_end(c);
+		});
+		return false;
+	}
+	void parse_rule() {
+		std::vector<StyleSheet::Selector> selectors;
+		do {
+			StyleSheet::Selector selector;
+			if (parse_selector(selector)) {
+				selectors.push_back(selector);
+			}
+		} while (parse(','));
+		if (!parse('{')) {
+			// a malformed rule is skipped up to the next closing brace, the following rules still apply
+			parse_until('}');
+			parse('}');
+			return;
+		}
+		const StringView declarations = parse_until('}');
+		parse('}');
+		for (const StyleSheet::Selector& selector: selectors) {
+			style_sheet.add_rule(selector, declarations);
+		}
+	}
+public:
+	StyleSheetParser(const StringView& s, StyleSheet& style_sheet): Parser(s), style_sheet(style_sheet) {}
+	void parse() {
+		skip_white_space_and_comments();
+		while (has_next()) {
+			if (parse('@')) {
+				// at-rules like @media or @font-face are skipped
+				parse_all([](Character c) {
+					return c != ';' && c != '{';
+				});
+				if (!parse(';')) {
+					skip_block();
+				}
+			}
+			else {
+				parse_rule();
+			}
+			skip_white_space_and_comments();
+		}
+	}
+};
+
 class TransformParser: public Parser {
 	using Parser::parse;
 public:
@@ -871,9 +1121,69 @@ public:
 
 class SVGParser: public XMLParser {
 	Document& document;
+	RenderOptions options;
+	Transformation root;
 	Transformation transformation;
 	Style style;
 	PaintServerMap paint_servers;
+	StyleSheet style_sheet;
+	// retained mode: the elements that are drawn and the shapes of the previous version
+	std::vector<Element>* elements = nullptr;
+	const Document* previous_document = nullptr;
+	std::map<std::uint64_t, const Element*> previous_elements;
+	std::set<std::string> element_keys;
+	std::vector<size_t> element_path;
+	std::uint64_t context = 14695981039346656037u;
+	// FNV-1a
+	static std::uint64_t hash(StringView s, std::uint64_t h) {
+		while (s.has_next()) {
+			h = (h ^ static_cast<unsigned char>(s.next())) * 1099511628211u;
+		}
+		return h;
+	}
+	static bool is_shape(const StringView& name) {
+		return name == "path" || name == "rect" || name == "circle" || name == "ellipse" || name == "line" || name == "polyline" || name == "polygon";
+	}
+	bool reuse_shapes(std::uint64_t fingerprint) {
+		auto i = previous_elements.find(fingerprint);
+		if (i == previous_elements.end()) {
+			return false;
+		}
+		const std::vector<Shape>& shapes = previous_document->shapes;
+		const SegmentStore& segments = previous_document->segments;
+		for (size_t j = i->second->first_shape; j < i->second->last_shape; ++j) {
+			// copy the shape and its segments, renumbering them for the new document
+			document.shapes.push_back(shapes[j]);
+			Shape& shape = document.shapes.back();
+			const std::uint32_t index = document.shapes.size() - 1;
+			shape.first_segment = document.segments.size();
+			for (size_t k = shapes[j].first_segment; k < shapes[j].last_segment; ++k) {
+				document.segments.append(segments.y0[k], segments.y1[k], segments.get_line(k), index, segments.direction[k]);
+			}
+			shape.last_segment = document.segments.size();
+		}
+		return true;
+	}
+	void add_element(const std::unique_ptr<XMLNode>& node, std::uint64_t fingerprint, size_t first_shape) {
+		Element element;
+		if (StringView id = node->get_attribute("id")) {
+			element.key = "#" + id.to_string();
+		}
+		if (element.key.empty() || !element_keys.insert(element.key).second) {
+			// no or a duplicate id, fall back to the position in the tree
+			element.key.clear();
+			for (size_t index: element_path) {
+				element.key += "/" + std::to_string(index);
+			}
+		}
+		element.fingerprint = fingerprint;
+		element.first_shape = first_shape;
+		element.last_shape = document.shapes.size();
+		for (size_t i = first_shape; i < element.last_shape; ++i) {
+			element.bounds = element.bounds | document.shapes[i].bounds;
+		}
+		elements->push_back(element);
+	}
 	float get_number(const std::unique_ptr<XMLNode>& node, const StringView& attribute, float default_value) {
 		if (StringView value = node->get_attribute(attribute)) {
 			Parser parser(value);
@@ -884,6 +1194,7 @@ class SVGParser: public XMLParser {
 		}
 	}
 	void parse_gradient(std::unique_ptr<XMLNode>& node, Gradient& gradient) {
+		style_sheet.apply(node);
 		if (StringView value = node->get_attribute("style")) {
 			StyleParser p(value);
 			p.parse_style(node);
@@ -950,7 +1261,23 @@ class SVGParser: public XMLParser {
 			paint_servers[id] = std::make_shared<RadialGradientPaintServer>(gradient);
 		}
 	}
+	void parse_style_sheets(std::unique_ptr<XMLNode>& node) {
+		if (node->get_name() == "style") {
+			for (const StringView& text: node->get_text()) {
+				StyleSheetParser p(text, style_sheet);
+				p.parse();
+			}
+		}
+		if (node->get_name() == "style" || node->get_name() == "defs") {
+			// style sheets and paint servers affect all elements
+			context = hash(node->get_source(), context);
+		}
+		for (auto& child: node->get_children()) {
+			parse_style_sheets(child);
+		}
+	}
 	void parse_style(std::unique_ptr<XMLNode>& node) {
+		style_sheet.apply(node);
 		if (StringView value = node->get_attribute("style")) {
 			StyleParser p(value);
 			p.parse_style(node);
@@ -975,18 +1302,35 @@ class SVGParser: public XMLParser {
 			Parser p(value);
 			style.stroke_opacity = p.parse_number();
 		}
+		if (StringView value = node->get_attribute("stroke-linejoin")) {
+			Parser p(value);
+			if (p.parse("round")) style.stroke_linejoin = LineJoin::ROUND;
+			else if (p.parse("bevel")) style.stroke_linejoin = LineJoin::BEVEL;
+			else if (p.parse("miter")) style.stroke_linejoin = LineJoin::MITER;
+		}
+		if (StringView value = node->get_attribute("stroke-linecap")) {
+			Parser p(value);
+			if (p.parse("round")) style.stroke_linecap = LineCap::ROUND;
+			else if (p.parse("square")) style.stroke_linecap = LineCap::SQUARE;
+			else if (p.parse("butt")) style.stroke_linecap = LineCap::BUTT;
+		}
+		if (StringView value = node->get_attribute("stroke-miterlimit")) {
+			Parser p(value);
+			style.stroke_miterlimit = p.parse_number();
+		}
 	}
-	void parse_node(std::unique_ptr<XMLNode>& node) {
-		Style previous_style = style;
-		parse_style(node);
-		Transformation previous_transformation = transformation;
-		if (StringView value = node->get_attribute("transform")) {
-			TransformParser p(value);
-			transformation = transformation * p.parse();
+	void parse_children(std::unique_ptr<XMLNode>& node) {
+		element_path.push_back(0);
+		for (auto& child: node->get_children()) {
+			parse_node(child);
+			++element_path.back();
 		}
+		element_path.pop_back();
+	}
+	void parse_element(std::unique_ptr<XMLNode>& node) {
 		const StringView& name = node->get_name();
 		if (name == "path") {
-			Path path(transformation);
+			Path path(transformation, options);
 			if (StringView value = node->get_attribute("d")) {
 				PathParser p(value, path);
 				p.parse();
@@ -994,7 +1338,7 @@ class SVGParser: public XMLParser {
 			document.draw(path, style, transformation);
 		}
 		else if (name == "rect") {
-			Path path(transformation);
+			Path path(transformation, options);
 			const float x = get_number(node, "x", 0.f);
 			const float y = get_number(node, "y", 0.f);
 			const float width = get_number(node, "width", 0.f);
@@ -1029,7 +1373,7 @@ class SVGParser: public XMLParser {
 			document.draw(path, style, transformation);
 		}
 		else if (name == "circle") {
-			Path path(transformation);
+			Path path(transformation, options);
 			const float cx = get_number(node, "cx", 0.f);
 			const float cy = get_number(node, "cy", 0.f);
 			const float r = get_number(node, "r", 0.f);
@@ -1039,7 +1383,7 @@ class SVGParser: public XMLParser {
 			document.draw(path, style, transformation);
 		}
 		else if (name == "ellipse") {
-			Path path(transformation);
+			Path path(transformation, options);
 			const float cx = get_number(node, "cx", 0.f);
 			const float cy = get_number(node, "cy", 0.f);
 			const float rx = get_number(node, "rx", 0.f);
@@ -1051,7 +1395,7 @@ class SVGParser: public XMLParser {
 			document.draw(path, style, transformation);
 		}
 		else if (name == "line") {
-			Path path(transformation);
+			Path path(transformation, options);
 			const float x1 = get_number(node, "x1", 0.f);
 			const float y1 = get_number(node, "y1", 0.f);
 			const float x2 = get_number(node, "x2", 0.f);
@@ -1062,7 +1406,7 @@ class SVGParser: public XMLParser {
 		}
 		else if (name == "polyline") {
 			if (StringView value = node->get_attribute("points")) {
-				Path path(transformation);
+				Path path(transformation, options);
 				PathParser p(value, path);
 				p.parse_polyline();
 				document.draw(path, style, transformation);
@@ -1070,7 +1414,7 @@ class SVGParser: public XMLParser {
 		}
 		else if (name == "polygon") {
 			if (StringView value = node->get_attribute("points")) {
-				Path path(transformation);
+				Path path(transformation, options);
 				PathParser p(value, path);
 				p.parse_polyline();
 				path.close();
@@ -1078,9 +1422,7 @@ class SVGParser: public XMLParser {
 			}
 		}
 		else if (name == "g") {
-			for (auto& child: node->get_children()) {
-				parse_node(child);
-			}
+			parse_children(node);
 		}
 		else if (name == "defs") {
 			for (auto& child: node->get_children()) {
@@ -1088,18 +1430,57 @@ class SVGParser: public XMLParser {
 			}
 		}
 		else {
-			for (auto& child: node->get_children()) {
-				parse_node(child);
-			}
+			parse_children(node);
+		}
+	}
+	void parse_node(std::unique_ptr<XMLNode>& node) {
+		const std::uint64_t previous_context = context;
+		if (elements) {
+			context = hash(node->get_start_tag(), context);
+		}
+		Style previous_style = style;
+		parse_style(node);
+		Transformation previous_transformation = transformation;
+		if (StringView value = node->get_attribute("transform")) {
+			TransformParser p(value);
+			transformation = transformation * p.parse();
+		}
+		const size_t first_shape = document.shapes.size();
+		if (elements && is_shape(node->get_name())) {
+			// shapes whose source did not change since the previous document are copied instead of parsed again
+			const std::uint64_t fingerprint = hash(node->get_source(), previous_context);
+			if (!reuse_shapes(fingerprint)) {
+				parse_element(node);
+			}
+			add_element(node, fingerprint, first_shape);
+		}
+		else {
+			parse_element(node);
 		}
 		transformation = previous_transformation;
 		style = previous_style;
+		context = previous_context;
 	}
 public:
-	SVGParser(const StringView& s, Document& document): XMLParser(s), document(document) {}
+	// the root transformation is applied in output pixels on top of the view box and the scale
+	SVGParser(const StringView& s, Document& document, const RenderOptions& options = RenderOptions(), const Transformation& root = Transformation()): XMLParser(s), document(document), options(options), root(root) {}
+	// parses in retained mode, shapes of elements that did not change since the previous document are reused
+	SVGParser(const StringView& s, Document& document, std::vector<Element>& elements, const Document& previous_document, const std::vector<Element>& previous_elements, const RenderOptions& options = RenderOptions(), const Transformation& root = Transformation()): XMLParser(s), document(document), options(options), root(root), elements(&elements), previous_document(&previous_document) {
+		for (const Element& element: previous_elements) {
+			this->previous_elements[element.fingerprint] = &element;
+		}
+	}
 	void parse() {
+		RASTER_TIME(PARSE);
+		// a tolerance of 0 would flatten every curve into infinitely many segments
+		if (!(options.tolerance > 0.f)) error("the tolerance must be positive");
+		if (!(options.min_size >= 0.f)) error("the minimum size must not be negative");
 		std::unique_ptr<XMLNode> root = XMLParser::parse();
 		if (root->get_name() != "svg") error("expected svg tag");
+		if (elements) {
+			context = hash(root->get_start_tag(), context);
+		}
+		parse_style_sheets(root);
 		struct {
 			float x = 0.f;
 			float y = 0.f;
@@ -1124,15 +1505,75 @@ public:
 		if (view_box.width > 0.f && view_box.height > 0.f) {
 			transformation = Transformation::scale(document.width/view_box.width, document.height/view_box.height) * Transformation::translate(-view_box.x, -view_box.y);
 		}
-		for (auto& child: root->get_children()) {
-			parse_node(child);
+		if (options.scale != 1.f) {
+			transformation = Transformation::scale(options.scale, options.scale) * transformation;
+			document.width *= options.scale;
+			document.height *= options.scale;
 		}
+		transformation = this->root * transformation;
+		parse_children(root);
+		document.finish();
 	}
 };
 
-Document parse(const StringView& svg) {
+Document parse(const StringView& svg, const RenderOptions& options) {
+	Document document;
+	SVGParser parser(svg, document, options);
+	parser.parse();
+	return document;
+}
+
+Document parse(const StringView& svg, const Transformation& root, const RenderOptions& options) {
 	Document document;
-	SVGParser parser(svg, document);
+	SVGParser parser(svg, document, options, root);
 	parser.parse();
 	return document;
 }
+
+RetainedDocument::RetainedDocument(const StringView& svg, const RenderOptions& options, const Transformation& root): pixmap(1, 1), options(options), root(root) {
+	update(svg);
+}
+
+Rectangle RetainedDocument::update(const StringView& svg) {
+	Document new_document;
+	std::vector<Element> new_elements;
+	SVGParser parser(svg, new_document, new_elements, document, elements, options, root);
+	parser.parse();
+
+	Rectangle dirty;
+	if (new_document.width != document.width || new_document.height != document.height || elements.empty()) {
+		pixmap = Pixmap(new_document.width, new_document.height);
+		dirty = Rectangle(0.f, 0.f, pixmap.get_width(), pixmap.get_height());
+	}
+	else {
+		// an element is unchanged if its key, its fingerprint and its order relative to the other unchanged elements are the same
+		std::map<std::string, size_t> keys;
+		for (size_t i = 0; i < elements.size(); ++i) {
+			keys[elements[i].key] = i;
+		}
+		std::vector<bool> unchanged(elements.size(), false);
+		size_t next = 0;
+		for (const Element& element: new_elements) {
+			auto i = keys.find(element.key);
+			if (i != keys.end() && i->second >= next && elements[i->second].fingerprint == element.fingerprint) {
+				unchanged[i->second] = true;
+				next = i->second + 1;
+			}
+			else {
+				dirty = dirty | element.bounds;
+			}
+		}
+		for (size_t i = 0; i < elements.size(); ++i) {
+			if (!unchanged[i]) {
+				dirty = dirty | elements[i].bounds;
+			}
+		}
+	}
+
+	document = std::move(new_document);
+	elements = std::move(new_elements);
+	if (!dirty.empty()) {
+		renderer.render(document, pixmap, dirty, options);
+	}
+	return dirty;
+}
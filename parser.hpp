@@ -7,6 +7,7 @@ All rights reserved.
 
 #include "document.hpp"
 #include <string>
+#include <cstdint>
 
 class Character {
 	char c;
@@ -69,4 +70,35 @@ public:
 	}
 };
 
-Document parse(const StringView& svg);
+Document parse(const StringView& svg, const RenderOptions& options = RenderOptions());
+// parses with an additional transformation in output pixels, the size of the document is not changed
+Document parse(const StringView& svg, const Transformation& root, const RenderOptions& options = RenderOptions());
+
+// a drawn element of a retained document and the range of shapes it produced
+struct Element {
+	std::string key;
+	std::uint64_t fingerprint;
+	size_t first_shape, last_shape;
+	Rectangle bounds;
+};
+
+// keeps the document and its pixmap between edits so that only the changed elements need to be rasterized again
+class RetainedDocument {
+	Document document;
+	std::vector<Element> elements;
+	Pixmap pixmap;
+	Renderer renderer;
+	RenderOptions options;
+	Transformation root;
+public:
+	// the options and the root transformation apply to every update, like for parse
+	RetainedDocument(const StringView& svg, const RenderOptions& options = RenderOptions(), const Transformation& root = Transformation());
+	// reuses the shapes of unchanged elements and returns the area that was rasterized again
+	Rectangle update(const StringView& svg);
+	const Document& get_document() const {
+		return document;
+	}
+	const Pixmap& get_pixmap() const {
+		return pixmap;
+	}
+};
@@ -6,12 +6,47 @@ All rights reserved.
 */
 
 #include "rasterizer.hpp"
+#include "scheduler.hpp"
 #include "png.hpp"
 #include <fstream>
+#include <string>
 #include <cmath>
+#include <cstdio>
 
 namespace {
 
+// writes to a temporary file next to the output that replaces the output only once the image is complete, so a render
+// that fails halfway does not leave a truncated image behind
+class OutputFile {
+	std::string file_name;
+	std::string temporary_name;
+	std::ofstream file;
+	bool committed = false;
+public:
+	OutputFile(const char* file_name): file_name(file_name), temporary_name(std::string(file_name) + ".part"), file(temporary_name, std::ios::binary) {
+		if (!file) {
+			throw std::string("could not open ") + file_name;
+		}
+	}
+	OutputFile(const OutputFile&) = delete;
+	~OutputFile() {
+		if (!committed) {
+			file.close();
+			std::remove(temporary_name.c_str());
+		}
+	}
+	std::ostream& get_stream() {
+		return file;
+	}
+	void commit() {
+		file.close();
+		if (!file || std::rename(temporary_name.c_str(), file_name.c_str()) != 0) {
+			throw std::string("could not write ") + file_name;
+		}
+		committed = true;
+	}
+};
+
 class Adler32 {
 	std::uint32_t s1 = 1;
 	std::uint32_t s2 = 0;
@@ -106,41 +141,45 @@ public:
 
 }
 
-void write_png(const Pixmap& pixmap, const char* file_name) {
-	const std::uint32_t width = pixmap.get_width();
-	const std::uint32_t height = pixmap.get_height();
-	std::ofstream file(file_name);
-
-	write<std::uint8_t>(file, {137, 'P', 'N', 'G', 13, 10, 26, 10});
-
-	write<std::uint32_t>(file, 13); // IHDR chunk length
-	Crc32 ihdr_crc;
-	auto ihdr_stream = combine_streams(file, ihdr_crc);
-	write<std::uint8_t>(ihdr_stream, {'I', 'H', 'D', 'R'});
-	write<std::uint32_t>(ihdr_stream, width);
-	write<std::uint32_t>(ihdr_stream, height);
-	write<std::uint8_t>(ihdr_stream, 8); // bit depth
-	write<std::uint8_t>(ihdr_stream, 6); // colour type = truecolor with alpha
-	write<std::uint8_t>(ihdr_stream, 0); // compression method
-	write<std::uint8_t>(ihdr_stream, 0); // filter method
-	write<std::uint8_t>(ihdr_stream, 0); // interlace method
-	write<std::uint32_t>(file, ihdr_crc);
-
-	write<std::uint32_t>(file, (width * 4 + 6) * height + 6); // IDAT chunk length
+struct ImageWriter::State {
+	std::ostream& file;
+	Format format;
+	std::uint32_t width, height;
+	std::uint32_t y = 0;
 	Crc32 idat_crc;
-	auto idat_stream = combine_streams(file, idat_crc);
-	write<std::uint8_t>(idat_stream, {'I', 'D', 'A', 'T'}); // chunk type
-	const std::uint8_t cmf = 8 | (15 - 8) << 4; // compression method and info
-	const std::uint8_t fdict = 0; // preset dictionary
-	const std::uint8_t flevel = 0; // compression level
-	const std::uint8_t fcheck = 31 - (cmf << 8 | fdict << 5 | flevel << 6) % 31;
-	const std::uint8_t flg = fcheck | fdict << 5 | flevel << 6;
-	write<std::uint8_t>(idat_stream, cmf);
-	write<std::uint8_t>(idat_stream, flg);
 	Adler32 adler;
-	auto data_stream = combine_streams(idat_stream, adler);
 	Random random;
-	for (std::uint32_t y = 0; y < height; ++y) {
+	State(std::ostream& file, Format format, std::uint32_t width, std::uint32_t height): file(file), format(format), width(width), height(height) {}
+	void write_header() {
+		write<std::uint8_t>(file, {137, 'P', 'N', 'G', 13, 10, 26, 10});
+
+		write<std::uint32_t>(file, 13); // IHDR chunk length
+		Crc32 ihdr_crc;
+		auto ihdr_stream = combine_streams(file, ihdr_crc);
+		write<std::uint8_t>(ihdr_stream, {'I', 'H', 'D', 'R'});
+		write<std::uint32_t>(ihdr_stream, width);
+		write<std::uint32_t>(ihdr_stream, height);
+		write<std::uint8_t>(ihdr_stream, 8); // bit depth
+		write<std::uint8_t>(ihdr_stream, 6); // colour type = truecolor with alpha
+		write<std::uint8_t>(ihdr_stream, 0); // compression method
+		write<std::uint8_t>(ihdr_stream, 0); // filter method
+		write<std::uint8_t>(ihdr_stream, 0); // interlace method
+		write<std::uint32_t>(file, ihdr_crc);
+
+		write<std::uint32_t>(file, (width * 4 + 6) * height + 6); // IDAT chunk length
+		auto idat_stream = combine_streams(file, idat_crc);
+		write<std::uint8_t>(idat_stream, {'I', 'D', 'A', 'T'}); // chunk type
+		const std::uint8_t cmf = 8 | (15 - 8) << 4; // compression method and info
+		const std::uint8_t fdict = 0; // preset dictionary
+		const std::uint8_t flevel = 0; // compression level
+		const std::uint8_t fcheck = 31 - (cmf << 8 | fdict << 5 | flevel << 6) % 31;
+		const std::uint8_t flg = fcheck | fdict << 5 | flevel << 6;
+		write<std::uint8_t>(idat_stream, cmf);
+		write<std::uint8_t>(idat_stream, flg);
+	}
+	void write_png_row(const Pixmap& pixmap, size_t row) {
+		auto idat_stream = combine_streams(file, idat_crc);
+		auto data_stream = combine_streams(idat_stream, adler);
 		const std::uint8_t is_final = y == height - 1;
 		write<std::uint8_t>(idat_stream, is_final);
 		const std::uint16_t length = convert_endianness<std::uint16_t>(1 + width * 4);
@@ -148,19 +187,162 @@ void write_png(const Pixmap& pixmap, const char* file_name) {
 		write<std::uint16_t>(idat_stream, ~length);
 		write<std::uint8_t>(data_stream, 0); // filter type
 		for (std::uint32_t x = 0; x < width; ++x) {
-			const Color color = pixmap.get_pixel(x, y).unpremultiply();
+			const Color color = pixmap.get_pixel(x, row).unpremultiply();
 			write<std::uint8_t>(data_stream, random.dither(color.r));
 			write<std::uint8_t>(data_stream, random.dither(color.g));
 			write<std::uint8_t>(data_stream, random.dither(color.b));
 			write<std::uint8_t>(data_stream, random.dither(color.a));
 		}
 	}
-	write<std::uint32_t>(idat_stream, adler);
-	write<std::uint32_t>(file, idat_crc);
+	void write_trailer() {
+		auto idat_stream = combine_streams(file, idat_crc);
+		write<std::uint32_t>(idat_stream, adler);
+		write<std::uint32_t>(file, idat_crc);
+
+		write<std::uint32_t>(file, 0); // IEND chunk length
+		Crc32 iend_crc;
+		auto iend_stream = combine_streams(file, iend_crc);
+		write<std::uint8_t>(iend_stream, {'I', 'E', 'N', 'D'}); // chunk type
+		write<std::uint32_t>(file, iend_crc);
+	}
+	void write_rgba_row(const Pixmap& pixmap, size_t row) {
+		for (std::uint32_t x = 0; x < width; ++x) {
+			const Color color = pixmap.get_pixel(x, row).unpremultiply();
+			write<std::uint8_t>(file, {random.dither(color.r), random.dither(color.g), random.dither(color.b), random.dither(color.a)});
+		}
+	}
+};
+
+ImageWriter::ImageWriter(std::ostream& stream, Format format, size_t width, size_t height): state(new State(stream, format, width, height)) {
+	RASTER_TIME(ENCODE);
+	if (format == Format::PNG) {
+		// the signature, the IHDR chunk and the start of the IDAT chunk
+		state->write_header();
+		RASTER_COUNT(BYTES_WRITTEN, 8 + 25 + 10);
+		if (height == 0) {
+			state->write_trailer();
+			RASTER_COUNT(BYTES_WRITTEN, 8 + 12);
+		}
+	}
+}
+
+ImageWriter::~ImageWriter() {}
+
+void ImageWriter::write_rows(const Pixmap& band) {
+	if (band.get_width() != state->width || state->y + band.get_height() > state->height) {
+		throw std::string("the band does not fit into the image");
+	}
+	RASTER_TIME(ENCODE);
+	for (size_t row = 0; row < band.get_height(); ++row) {
+		if (state->format == Format::PNG) {
+			state->write_png_row(band, row);
+			RASTER_COUNT(BYTES_WRITTEN, 5 + 1 + 4 * state->width);
+		}
+		else {
+			state->write_rgba_row(band, row);
+			RASTER_COUNT(BYTES_WRITTEN, 4 * state->width);
+		}
+		++state->y;
+	}
+	if (state->format == Format::PNG && state->y == state->height && band.get_height() > 0) {
+		state->write_trailer();
+		RASTER_COUNT(BYTES_WRITTEN, 8 + 12);
+	}
+}
+
+void write_png(const Pixmap& pixmap, std::ostream& file) {
+	ImageWriter writer(file, ImageWriter::Format::PNG, pixmap.get_width(), pixmap.get_height());
+	writer.write_rows(pixmap);
+}
+
+void write_png(const Pixmap& pixmap, const char* file_name) {
+	OutputFile file(file_name);
+	write_png(pixmap, file.get_stream());
+	file.commit();
+}
+
+void write_rgba(const Pixmap& pixmap, std::ostream& stream) {
+	ImageWriter writer(stream, ImageWriter::Format::RGBA, pixmap.get_width(), pixmap.get_height());
+	writer.write_rows(pixmap);
+}
+
+void write_image(Scheduler& scheduler, std::vector<Renderer>& renderers, const Scene& scene, const Rectangle& viewport, const RenderOptions& options, ImageWriter& writer) {
+	const Rectangle pixels = get_viewport_pixels(viewport);
+	const size_t x0 = pixels.x0;
+	const size_t y0 = pixels.y0;
+	const size_t x1 = pixels.x1;
+	const size_t y1 = pixels.y1;
+	const size_t thread_count = renderers.size();
+	// the bands share one deadline and every renderer gets its share of the memory budget
+	RenderOptions band_options = start_time_limit(options);
+	band_options.memory_budget = options.memory_budget / thread_count;
+	// a few bands per thread keep the threads busy, bands of less than 16 rows repeat too much work
+	const size_t band_height = std::min(renderers.front().get_band_height(scene, pixels, band_options), std::max((y1 - y0 + 4 * thread_count - 1) / (4 * thread_count), static_cast<size_t>(16)));
+	const size_t band_count = (y1 - y0 + band_height - 1) / band_height;
+	// finished bands wait here until all bands above them are encoded, their memory is counted by the renderer that
+	// rendered them until then
+	std::vector<std::unique_ptr<Pixmap>> bands(band_count);
+	std::vector<Renderer*> owners(band_count);
+	std::mutex mutex;
+	size_t next_band = 0;
+	bool encoding = false;
+	auto render_band = [&](size_t i) {
+		const size_t y = y0 + i * band_height;
+		std::unique_ptr<Pixmap> band(new Pixmap(x1 - x0, std::min(band_height, y1 - y)));
+		Renderer& renderer = renderers[scheduler.get_thread_index()];
+		renderer.hold_memory(band->get_memory_usage());
+		try {
+			RASTER_TRACE("band");
+			renderer.render(scene, *band, x0, y, Rectangle(x0, y, x1, y + band->get_height()), band_options);
+		} catch (...) {
+			renderer.release_memory(band->get_memory_usage());
+			throw;
+		}
+		std::unique_lock<std::mutex> lock(mutex);
+		bands[i] = std::move(band);
+		owners[i] = &renderer;
+		if (encoding) {
+			return;
+		}
+		// this task encodes all bands that are ready, the others keep rendering
+		encoding = true;
+		while (next_band < band_count && bands[next_band]) {
+			std::unique_ptr<Pixmap> band = std::move(bands[next_band]);
+			lock.unlock();
+			writer.write_rows(*band);
+			owners[next_band]->release_memory(band->get_memory_usage());
+			lock.lock();
+			++next_band;
+		}
+		encoding = false;
+	};
+	// with a memory budget at most one band per thread is alive at a time
+	const size_t wave = options.memory_budget > 0 ? thread_count : band_count;
+	for (size_t first = 0; first < band_count; first += wave) {
+		parallel_for(scheduler, std::min(wave, band_count - first), [&](size_t i) {
+			render_band(first + i);
+		});
+	}
+}
+
+void write_png(Scheduler& scheduler, std::vector<Renderer>& renderers, const Scene& scene, size_t width, size_t height, const RenderOptions& options, const char* file_name) {
+	// fail before creating the file if the render does not fit into the budget
+	RenderOptions band_options = options;
+	band_options.memory_budget = options.memory_budget / renderers.size();
+	renderers.front().get_band_height(scene, Rectangle(0.f, 0.f, width, height), band_options);
+	OutputFile file(file_name);
+	ImageWriter writer(file.get_stream(), ImageWriter::Format::PNG, width, height);
+	write_image(scheduler, renderers, scene, Rectangle(0.f, 0.f, width, height), options, writer);
+	file.commit();
+}
 
-	write<std::uint32_t>(file, 0); // IEND chunk length
-	Crc32 iend_crc;
-	auto iend_stream = combine_streams(file, iend_crc);
-	write<std::uint8_t>(iend_stream, {'I', 'E', 'N', 'D'}); // chunk type
-	write<std::uint32_t>(file, iend_crc);
+void write_png(Renderer& renderer, const Scene& scene, size_t width, size_t height, const RenderOptions& options, const char* file_name) {
+	// fail before creating the file if the render does not fit into the budget
+	renderer.get_band_height(scene, Rectangle(0.f, 0.f, width, height), options);
+	OutputFile file(file_name);
+	ImageWriter writer(file.get_stream(), ImageWriter::Format::PNG, width, height);
+	renderer.render(scene, Rectangle(0.f, 0.f, width, height), options, [&](const Pixmap& band) {
+		writer.write_rows(band);
+	});
+	file.commit();
 }
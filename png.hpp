@@ -5,4 +5,32 @@ All rights reserved.
 
 */
 
+#include <ostream>
+
+class Scheduler;
+
+// encodes an image from bands of rows that are passed from top to bottom, the rows are written as soon as they arrive
+class ImageWriter {
+	struct State;
+	std::unique_ptr<State> state;
+public:
+	enum class Format {
+		PNG,
+		// unpremultiplied 8 bit RGBA without any header
+		RGBA
+	};
+	ImageWriter(std::ostream& stream, Format format, size_t width, size_t height);
+	~ImageWriter();
+	void write_rows(const Pixmap& band);
+};
+
+void write_png(const Pixmap& pixmap, std::ostream& stream);
 void write_png(const Pixmap& pixmap, const char* file_name);
+// writes the pixels as unpremultiplied 8 bit RGBA without any header
+void write_rgba(const Pixmap& pixmap, std::ostream& stream);
+// renders the scene band by band within the memory budget of the options and streams the bands to the file
+void write_png(Renderer& renderer, const Scene& scene, size_t width, size_t height, const RenderOptions& options, const char* file_name);
+// renders the bands of the viewport as tasks on the scheduler, every thread with the renderer at its thread index, and
+// encodes every band as soon as it and all bands above it are rendered. the output does not depend on the thread count
+void write_image(Scheduler& scheduler, std::vector<Renderer>& renderers, const Scene& scene, const Rectangle& viewport, const RenderOptions& options, ImageWriter& writer);
+void write_png(Scheduler& scheduler, std::vector<Renderer>& renderers, const Scene& scene, size_t width, size_t height, const RenderOptions& options, const char* file_name);
@@ -8,25 +8,28 @@ All rights reserved.
 #include "rasterizer.hpp"
 #include "png.hpp"
 #include <vector>
-#include <map>
-#include <queue>
 #include <algorithm>
 #include <utility>
 #include <cmath>
+#include <cstdint>
+#include <string>
 
 namespace {
 
-struct ShapeMap: std::map<const Shape*, int> {
+// the winding numbers of the shapes, sorted by paint order and stored in a vector that keeps its memory when cleared
+struct ShapeMap: std::vector<std::pair<const Shape*, int>> {
 	void modify(const Shape* shape, int direction) {
-		auto iter = find(shape);
-		if (iter != end()) {
+		auto iter = std::lower_bound(begin(), end(), shape, [](const value_type& pair, const Shape* shape) {
+			return pair.first < shape;
+		});
+		if (iter != end() && iter->first == shape) {
 			iter->second += direction;
 			if (iter->second == 0) {
 				erase(iter);
 			}
 		}
 		else {
-			insert(std::make_pair(shape, direction));
+			insert(iter, std::make_pair(shape, direction));
 		}
 	}
 	Color get_color(const Point& point) const {
@@ -34,6 +37,7 @@ struct ShapeMap: std::map<const Shape*, int> {
 		for (auto& pair: *this) {
 			color = blend(color, pair.first->paint->evaluate(point));
 		}
+		RASTER_COUNT(PAINT_EVALUATIONS, size());
 		return color;
 	}
 };
@@ -44,10 +48,176 @@ struct RasterizeLine: Line {
 	RasterizeLine(const Line& line, int direction, const Shape* shape): Line(line), direction(direction), shape(shape) {}
 };
 
+// the pixmap that is rendered into and the position of its top left pixel in the scene
+struct Target {
+	Pixmap& pixmap;
+	size_t x0, y0;
+	Target(Pixmap& pixmap, size_t x0, size_t y0): pixmap(pixmap), x0(x0), y0(y0) {}
+	void add_pixel(size_t x, size_t y, const Color& color) const {
+		pixmap.add_pixel(x - x0, y - y0, color);
+	}
+};
+
+// coverage of hairlines, computed per pixel before the sweep
+class HairlineMap {
+	struct Sample {
+		size_t y, x;
+		const Shape* shape;
+		float coverage;
+		constexpr Sample(size_t y, size_t x, const Shape* shape, float coverage): y(y), x(x), shape(shape), coverage(coverage) {}
+		bool operator <(const Sample& s) const {
+			return y != s.y ? y < s.y : (x != s.x ? x < s.x : shape < s.shape);
+		}
+	};
+	std::vector<Sample> samples;
+	// for every pixel with samples: its first sample and the color of the hairlines alone
+	std::vector<size_t> pixels;
+	std::vector<Color> colors;
+	Rectangle clip;
+	void add_sample(float x, float y, const Shape* shape, float coverage) {
+		if (coverage > 0.f && x >= clip.x0 && x < clip.x1 && y >= clip.y0 && y < clip.y1) {
+			samples.emplace_back(y, x, shape, std::min(coverage, 1.f));
+		}
+	}
+	// covers the pixels along the major axis with a band of the line's thickness along the minor axis. only the part of
+	// the line whose band reaches the clip range [u_min, u_max) x [v_min, v_max) is visited
+	template <class F> void add_line(float u0, float v0, float u1, float v1, float width, float u_min, float u_max, float v_min, float v_max, F&& add) {
+		if (u0 > u1) {
+			std::swap(u0, u1);
+			std::swap(v0, v1);
+		}
+		const float du = u1 - u0;
+		const float dv = v1 - v0;
+		if (du == 0.f) {
+			return;
+		}
+		const float slope = dv / du;
+		const float thickness = width * std::sqrt(du * du + dv * dv) / du;
+		// clip in double so that far away end points do not cost the clipped line its precision
+		double c0 = std::max<double>(u0, u_min);
+		double c1 = std::min<double>(u1, u_max);
+		const double reach = thickness * .5 + 2.0;
+		if (slope != 0.f) {
+			double e0 = u0 + (v_min - reach - v0) / slope;
+			double e1 = u0 + (v_max + reach - v0) / slope;
+			if (e0 > e1) std::swap(e0, e1);
+			c0 = std::max(c0, e0);
+			c1 = std::min(c1, e1);
+		}
+		else if (v0 + reach < v_min || v0 - reach > v_max) {
+			return;
+		}
+		if (c0 >= c1) {
+			return;
+		}
+		const float cu0 = c0;
+		const float cu1 = c1;
+		const float cv0 = v0 + (c0 - u0) * slope;
+		for (std::int64_t i = std::floor(cu0); i < cu1; ++i) {
+			const float u = i;
+			const float a = std::max(u, cu0);
+			const float b = std::min(u + 1.f, cu1);
+			const float v = cv0 + ((a + b) * .5f - cu0) * slope;
+			const float top = v - thickness * .5f;
+			const float bottom = v + thickness * .5f;
+			for (std::int64_t j = std::max(std::floor(top), v_min); j < bottom && j < v_max; ++j) {
+				const float w = j;
+				add(u, w, (std::min(w + 1.f, bottom) - std::max(w, top)) * (b - a));
+			}
+		}
+	}
+public:
+	size_t get_memory_usage() const {
+		return samples.capacity() * sizeof(Sample) + pixels.capacity() * sizeof(size_t) + colors.capacity() * sizeof(Color);
+	}
+	// starts over with an empty map, keeping the memory
+	void reset(const Rectangle& clip) {
+		samples.clear();
+		pixels.clear();
+		colors.clear();
+		this->clip = clip;
+	}
+	void add(const Shape& shape) {
+		for (const Hairline& h: shape.hairlines) {
+			const Shape* s = &shape;
+			if (std::abs(h.p1.x - h.p0.x) >= std::abs(h.p1.y - h.p0.y)) {
+				add_line(h.p0.x, h.p0.y, h.p1.x, h.p1.y, h.width, clip.x0, clip.x1, clip.y0, clip.y1, [&](float x, float y, float coverage) {
+					add_sample(x, y, s, coverage);
+				});
+			}
+			else {
+				add_line(h.p0.y, h.p0.x, h.p1.y, h.p1.x, h.width, clip.y0, clip.y1, clip.x0, clip.x1, [&](float y, float x, float coverage) {
+					add_sample(x, y, s, coverage);
+				});
+			}
+		}
+	}
+	// composites the hairlines over an empty pixmap, the sweep later corrects the pixels covered by shapes
+	void finish(const Target& target) {
+		std::sort(samples.begin(), samples.end());
+		// the segments of a polyline meet at their end points, use the maximum coverage instead of the sum there
+		size_t n = 0;
+		for (size_t i = 0; i < samples.size(); ++i) {
+			if (n > 0 && samples[n-1].y == samples[i].y && samples[n-1].x == samples[i].x && samples[n-1].shape == samples[i].shape) {
+				samples[n-1].coverage = std::max(samples[n-1].coverage, samples[i].coverage);
+			}
+			else {
+				samples[n++] = samples[i];
+			}
+		}
+		samples.erase(samples.begin() + n, samples.end());
+		for (size_t i = 0; i < samples.size(); ++i) {
+			if (i == 0 || samples[i-1].y != samples[i].y || samples[i-1].x != samples[i].x) {
+				pixels.push_back(i);
+			}
+		}
+		pixels.push_back(samples.size());
+		ShapeMap shapes;
+		for (size_t i = 0; i + 1 < pixels.size(); ++i) {
+			const Sample& sample = samples[pixels[i]];
+			const Color color = get_color(i, shapes, Point(static_cast<float>(sample.x) + .5f, static_cast<float>(sample.y) + .5f));
+			colors.push_back(color);
+			target.add_pixel(sample.x, sample.y, color);
+		}
+	}
+	// returns the index of the pixel or -1
+	int find(size_t x, size_t y) const {
+		if (pixels.empty()) {
+			return -1;
+		}
+		auto i = std::lower_bound(pixels.begin(), pixels.end() - 1, Sample(y, x, nullptr, 0.f), [this](size_t i, const Sample& s) {
+			return samples[i] < s;
+		});
+		if (i == pixels.end() - 1 || samples[*i].y != y || samples[*i].x != x) {
+			return -1;
+		}
+		return i - pixels.begin();
+	}
+	const Color& get_hairline_color(int pixel) const {
+		return colors[pixel];
+	}
+	// blends the shapes and the hairlines of the pixel in paint order
+	Color get_color(int pixel, const ShapeMap& shapes, const Point& point) const {
+		Color color;
+		auto shape = shapes.begin();
+		for (size_t i = pixels[pixel]; i < pixels[pixel+1]; ++i) {
+			const Sample& sample = samples[i];
+			for (; shape != shapes.end() && shape->first < sample.shape; ++shape) {
+				color = blend(color, shape->first->paint->evaluate(point));
+			}
+			color = blend(color, sample.shape->paint->evaluate(point) * sample.coverage);
+		}
+		for (; shape != shapes.end(); ++shape) {
+			color = blend(color, shape->first->paint->evaluate(point));
+		}
+		RASTER_COUNT(PAINT_EVALUATIONS, shapes.size() + pixels[pixel+1] - pixels[pixel]);
+		return color;
+	}
+};
+
 struct Strip {
 	float y0, y1;
 	std::vector<RasterizeLine> lines;
-	Strip(float y0, float y1): y0(y0), y1(y1) {}
 };
 
 struct Trapezoid {
@@ -115,106 +285,428 @@ float rasterize_pixel(const Trapezoid& trapezoid, size_t x) {
 	return area;
 }
 
-void rasterize_row(const Strip& strip, Pixmap& pixmap, size_t y) {
-	float y0 = std::max(static_cast<float>(y), strip.y0);
-	float y1 = std::min(static_cast<float>(y+1), strip.y1);
-	ShapeMap shapes;
-	for (size_t i = 1; i < strip.lines.size(); ++i) {
-		const RasterizeLine& l0 = strip.lines[i-1];
-		shapes.modify(l0.shape, l0.direction);
+// the part of a line inside a row
+struct Edge {
+	float x0, x1;
+	int direction;
+	const Shape* shape;
+	constexpr Edge(float x0, float x1, int direction, const Shape* shape): x0(x0), x1(x1), direction(direction), shape(shape) {}
+};
+
+void rasterize_row(const std::vector<Edge>& edges, float y0, float y1, size_t y, const Target& target, const Rectangle& clip, const HairlineMap& hairlines, ShapeMap& shapes) {
+	shapes.clear();
+	for (size_t i = 1; i < edges.size(); ++i) {
+		const Edge& e0 = edges[i-1];
+		shapes.modify(e0.shape, e0.direction);
 		if (!shapes.empty()) {
-			const RasterizeLine& l1 = strip.lines[i];
-			Trapezoid trapezoid(y0, y1, l0, l1);
+			const Edge& e1 = edges[i];
+			Trapezoid trapezoid(y0, y1, e0.x0, e0.x1, e1.x0, e1.x1);
 			if (trapezoid.x0 > trapezoid.x1) std::swap(trapezoid.x0, trapezoid.x1);
 			if (trapezoid.x2 > trapezoid.x3) std::swap(trapezoid.x2, trapezoid.x3);
-			const float x0 = std::max(trapezoid.x0, 0.f);
-			const float x1 = std::min(trapezoid.x3, pixmap.get_width() - .5f);
+			const float x0 = std::max(trapezoid.x0, clip.x0);
+			const float x1 = std::min(trapezoid.x3, clip.x1 - .5f);
+			RASTER_COUNT(TRAPEZOIDS, 1);
 			for (size_t x = x0; x < x1; ++x) {
+				RASTER_COUNT(PIXELS, 1);
 				const float factor = rasterize_pixel(trapezoid, x);
-				const Color color = shapes.get_color(Point(static_cast<float>(x) + .5f, static_cast<float>(y) + .5f));
-				pixmap.add_pixel(x, y, color * factor);
+				const Point point(static_cast<float>(x) + .5f, static_cast<float>(y) + .5f);
+				const int pixel = hairlines.find(x, y);
+				if (pixel >= 0) {
+					// replace the hairlines alone with the hairlines blended with the shapes for this part of the pixel
+					const Color color = hairlines.get_color(pixel, shapes, point) + hairlines.get_hairline_color(pixel) * -1.f;
+					target.add_pixel(x, y, color * factor);
+				}
+				else {
+					const Color color = shapes.get_color(point);
+					target.add_pixel(x, y, color * factor);
+				}
 			}
 		}
 	}
 }
 
-void rasterize_strip(const Strip& strip, Pixmap& pixmap) {
-	const float y0 = std::max(strip.y0, 0.f);
-	const float y1 = std::min(strip.y1, pixmap.get_height() - .5f);
+void rasterize_strip(const Strip& strip, const Target& target, const Rectangle& clip, const HairlineMap& hairlines, std::vector<Edge>& edges, ShapeMap& shapes) {
+	const float y0 = std::max(strip.y0, clip.y0);
+	const float y1 = std::min(strip.y1, clip.y1 - .5f);
 	for (size_t y = y0; y < y1; ++y) {
-		rasterize_row(strip, pixmap, y);
+		const float row_y0 = std::max(static_cast<float>(y), strip.y0);
+		const float row_y1 = std::min(static_cast<float>(y+1), strip.y1);
+		edges.clear();
+		for (const RasterizeLine& line: strip.lines) {
+			edges.emplace_back(line.get_x(row_y0), line.get_x(row_y1), line.direction, line.shape);
+		}
+		rasterize_row(edges, row_y0, row_y1, y, target, clip, hairlines, shapes);
 	}
 }
 
-struct Event {
+template <class T> struct Event {
 	enum class Type {
 		LINE_START,
 		LINE_END
 	};
 	Type type;
-	float y;
+	T y;
 	size_t index;
-	constexpr Event(Type type, float y, size_t index): type(type), y(y), index(index) {}
-	constexpr bool operator >(const Event& event) const {
-		return y > event.y;
+	constexpr Event(Type type, T y, size_t index): type(type), y(y), index(index) {}
+};
+
+// enforces the cancellation, the deadline and the complexity limits of the options during a render
+class Budget {
+	const RenderOptions& options;
+	size_t strips = 0;
+	void check_strips() const {
+		if (options.max_strips > 0 && strips > options.max_strips) {
+			throw std::string("the render needs more than ") + std::to_string(options.max_strips) + " strips";
+		}
+	}
+public:
+	Budget(const RenderOptions& options): options(options) {}
+	void check() const {
+		if (options.cancellation && options.cancellation->is_cancelled()) {
+			throw std::string("the render was cancelled");
+		}
+		if (options.deadline != std::chrono::steady_clock::time_point::max() && std::chrono::steady_clock::now() > options.deadline) {
+			throw std::string("the render exceeded its deadline");
+		}
+	}
+	void check_segments(size_t segments) const {
+		if (options.max_segments > 0 && segments > options.max_segments) {
+			throw std::string("the scene has ") + std::to_string(segments) + " segments, the limit is " + std::to_string(options.max_segments);
+		}
+	}
+	void check_events(size_t events) const {
+		if (options.max_events > 0 && events > options.max_events) {
+			throw std::string("the render has ") + std::to_string(events) + " events, the limit is " + std::to_string(options.max_events);
+		}
+	}
+	// every distinct y of the sorted events starts a strip, intersections add more during the sweep
+	template <class T> void estimate_strips(const std::vector<Event<T>>& events) {
+		for (size_t i = 0; i < events.size(); ++i) {
+			if (i == 0 || events[i].y != events[i-1].y) {
+				++strips;
+			}
+		}
+		check_strips();
+		strips = 0;
+	}
+	void start_strip() {
+		RASTER_COUNT(STRIPS, 1);
+		++strips;
+		check_strips();
+		check();
 	}
 };
 
+// collects the start and end events of the segments of the visible shapes, sorted by y
+template <class T, class F> void get_events(const Scene& scene, const std::vector<std::uint32_t>& visible, std::vector<Event<T>>& events, F convert) {
+	RASTER_TIME(EVENTS);
+	const SegmentView segments = scene.get_segments();
+	events.clear();
+	for (std::uint32_t shape: visible) {
+		for (size_t i = scene.shapes[shape].first_segment; i < scene.shapes[shape].last_segment; ++i) {
+			events.emplace_back(Event<T>::Type::LINE_START, convert(segments.y0[i]), i);
+			events.emplace_back(Event<T>::Type::LINE_END, convert(segments.y1[i]), i);
+		}
+	}
+	std::sort(events.begin(), events.end(), [](const Event<T>& e0, const Event<T>& e1) {
+		return e0.y < e1.y;
+	});
+	RASTER_COUNT(EVENTS, events.size());
 }
 
-void rasterize(const std::vector<Shape>& shapes, const char* file_name, size_t width, size_t height) {
-	// collect lines and events
-	std::vector<RasterizeLine> lines;
-	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
-	for (const Shape& shape: shapes) {
-		for (const Segment& s: shape.segments) {
-			const size_t index = lines.size();
-			if (s.y0 < s.y1) {
-				lines.push_back(RasterizeLine(s.line, 1, &shape));
-				events.push(Event(Event::Type::LINE_START, s.y0, index));
-				events.push(Event(Event::Type::LINE_END, s.y1, index));
+// fixed point coordinates with 8 fractional bits, x positions are evaluated with 16 fractional bits
+using Fixed = std::int64_t;
+constexpr Fixed FIXED_ONE = 256;
+constexpr float FIXED_RANGE = 65536.f;
+
+Fixed to_fixed(float value) {
+	return std::llround(clamp(value, -FIXED_RANGE, FIXED_RANGE) * FIXED_ONE);
+}
+
+constexpr Fixed floor_div(Fixed a, Fixed b) {
+	// b is always positive
+	return a / b - (a % b < 0 ? 1 : 0);
+}
+
+struct FixedLine {
+	Fixed x0, y0, dx, dy;
+	// the part of the line that is swept
+	Fixed y_start, y_end;
+	int direction;
+	const Shape* shape;
+	FixedLine(Fixed x0, Fixed y0, Fixed x1, Fixed y1, Fixed y_start, Fixed y_end, int direction, const Shape* shape): x0(x0), y0(y0), dx(x1 - x0), dy(y1 - y0), y_start(y_start), y_end(y_end), direction(direction), shape(shape) {}
+	// returns the x position at y with 16 fractional bits, rounded down
+	constexpr Fixed get_x(Fixed y) const {
+		return x0 * FIXED_ONE + floor_div(dx * FIXED_ONE * (y - y0), dy);
+	}
+	constexpr bool less(const FixedLine& l, Fixed y) const {
+		return get_x(y) != l.get_x(y) ? get_x(y) < l.get_x(y) : dx * l.dy < l.dx * dy;
+	}
+};
+
+// steps the x position of a line from row to row using only additions
+class FixedStepper {
+	Fixed x, error;
+	Fixed step, step_error;
+	Fixed dy;
+public:
+	FixedStepper(const FixedLine& line, Fixed y): dy(line.dy) {
+		const Fixed n = line.dx * FIXED_ONE * (y - line.y0);
+		x = line.x0 * FIXED_ONE + floor_div(n, dy);
+		error = n - floor_div(n, dy) * dy;
+		const Fixed d = line.dx * FIXED_ONE * FIXED_ONE;
+		step = floor_div(d, dy);
+		step_error = d - step * dy;
+	}
+	Fixed get_x() const {
+		return x;
+	}
+	void next() {
+		x += step;
+		error += step_error;
+		if (error >= dy) {
+			x += 1;
+			error -= dy;
+		}
+	}
+};
+
+constexpr float to_float(Fixed x) {
+	return x * (1.f / (FIXED_ONE * FIXED_ONE));
+}
+
+void rasterize_strip(const std::vector<const FixedLine*>& lines, Fixed strip_y0, Fixed strip_y1, const Target& target, const Rectangle& clip, const HairlineMap& hairlines, std::vector<FixedStepper>& steppers, std::vector<Edge>& edges, ShapeMap& shapes) {
+	const Fixed first_row = std::max(floor_div(strip_y0, FIXED_ONE), static_cast<Fixed>(clip.y0));
+	const Fixed last_row = std::min(floor_div(strip_y1 - 1, FIXED_ONE) + 1, static_cast<Fixed>(clip.y1));
+	if (first_row >= last_row) {
+		return;
+	}
+	steppers.clear();
+	edges.clear();
+	for (const FixedLine* line: lines) {
+		steppers.emplace_back(*line, (first_row + 1) * FIXED_ONE);
+		edges.emplace_back(0.f, to_float(line->get_x(std::max(first_row * FIXED_ONE, strip_y0))), line->direction, line->shape);
+	}
+	for (Fixed row = first_row; row < last_row; ++row) {
+		const Fixed y0 = std::max(row * FIXED_ONE, strip_y0);
+		const Fixed y1 = std::min((row + 1) * FIXED_ONE, strip_y1);
+		for (size_t i = 0; i < lines.size(); ++i) {
+			edges[i].x0 = edges[i].x1;
+			if (y1 == (row + 1) * FIXED_ONE) {
+				edges[i].x1 = to_float(steppers[i].get_x());
+				steppers[i].next();
 			}
 			else {
-				lines.push_back(RasterizeLine(s.line, -1, &shape));
-				events.push(Event(Event::Type::LINE_START, s.y1, index));
-				events.push(Event(Event::Type::LINE_END, s.y0, index));
+				edges[i].x1 = to_float(lines[i]->get_x(y1));
 			}
 		}
+		rasterize_row(edges, static_cast<float>(y0) / FIXED_ONE, static_cast<float>(y1) / FIXED_ONE, row, target, clip, hairlines, shapes);
 	}
+}
 
-	Pixmap pixmap(width, height);
+// the memory used while rasterizing, kept from one render to the next
+struct Buffers {
+	std::vector<std::uint32_t> visible;
+	HairlineMap hairlines;
+	std::vector<Event<float>> events;
+	std::vector<std::uint32_t> current_lines;
+	Strip strip;
+	std::vector<Edge> edges;
+	ShapeMap shapes;
+	std::vector<Event<Fixed>> fixed_events;
+	std::vector<FixedLine> fixed_lines;
+	std::vector<const FixedLine*> current_fixed_lines;
+	std::vector<FixedStepper> steppers;
+	template <class T> static size_t get_memory_usage(const std::vector<T>& v) {
+		return v.capacity() * sizeof(T);
+	}
+	size_t get_memory_usage() const {
+		return get_memory_usage(visible) + hairlines.get_memory_usage() + get_memory_usage(events) + get_memory_usage(current_lines) + get_memory_usage(strip.lines) + get_memory_usage(edges) + get_memory_usage(shapes) + get_memory_usage(fixed_events) + get_memory_usage(fixed_lines) + get_memory_usage(current_fixed_lines) + get_memory_usage(steppers);
+	}
+	// a rough upper bound of the memory a sweep needs for every visible segment and hairline, the vectors grow by doubling
+	static size_t get_segment_cost(bool fixed_point) {
+		if (fixed_point) {
+			// a segment is clipped into up to three lines
+			return 2 * (3 * (2 * sizeof(Event<Fixed>) + sizeof(FixedLine) + sizeof(const FixedLine*) + sizeof(FixedStepper)) + sizeof(Edge) + sizeof(ShapeMap::value_type));
+		}
+		return 2 * (2 * sizeof(Event<float>) + sizeof(std::uint32_t) + sizeof(RasterizeLine) + sizeof(Edge) + sizeof(ShapeMap::value_type));
+	}
+};
 
-	float y = events.empty() ? 0.f : events.top().y;
-	std::vector<const RasterizeLine*> current_lines;
-	while (!events.empty()) {
-		Event event = events.top();
-		events.pop();
+void sweep(const Scene& scene, Buffers& buffers, const Target& target, const Rectangle& clip, Budget& budget) {
+	using Event = ::Event<float>;
+	std::vector<Event>& events = buffers.events;
+	get_events<float>(scene, buffers.visible, events, [](float y) {
+		return y;
+	});
+	budget.estimate_strips(events);
+	const std::vector<Shape>& shapes = scene.shapes;
+	const SegmentView segments = scene.get_segments();
+	const float* m = segments.m;
+	const float* x0 = segments.x0;
+
+	float y = events.empty() ? 0.f : events.front().y;
+	std::vector<std::uint32_t>& current_lines = buffers.current_lines;
+	current_lines.clear();
+	for (const Event& event: events) {
 		while (y < event.y) {
-			std::sort(current_lines.begin(), current_lines.end(), [y](const RasterizeLine* l0, const RasterizeLine* l1) {
-				const float x0 = l0->get_x(y);
-				const float x1 = l1->get_x(y);
-				if (x0 == x1) {
-					return l0->m < l1->m;
+			std::sort(current_lines.begin(), current_lines.end(), [&, y](std::uint32_t l0, std::uint32_t l1) {
+				const float x_0 = m[l0] * y + x0[l0];
+				const float x_1 = m[l1] * y + x0[l1];
+				if (x_0 == x_1) {
+					return m[l0] < m[l1];
 				}
-				return x0 < x1;
+				return x_0 < x_1;
 			});
+			// lines that just crossed at y may still be in the wrong order due to rounding
+			for (size_t i = 1; i < current_lines.size(); ++i) {
+				for (size_t j = i; j > 0; --j) {
+					const std::uint32_t l0 = current_lines[j-1];
+					const std::uint32_t l1 = current_lines[j];
+					if (m[l0] <= m[l1] || std::abs((m[l0] * y + x0[l0]) - (m[l1] * y + x0[l1])) > 1e-3f) {
+						break;
+					}
+					std::swap(current_lines[j-1], current_lines[j]);
+				}
+			}
+			budget.start_strip();
 			float next_y = event.y;
 			// find intersections
 			for (size_t i = 1; i < current_lines.size(); ++i) {
-				const RasterizeLine& l0 = *current_lines[i-1];
-				const RasterizeLine& l1 = *current_lines[i];
-				if (l0.m != l1.m) {
-					const float intersection = intersect(l0, l1);
+				const std::uint32_t l0 = current_lines[i-1];
+				const std::uint32_t l1 = current_lines[i];
+				if (m[l0] != m[l1]) {
+					const float intersection = intersect(segments.get_line(l0), segments.get_line(l1));
 					if (y < intersection && intersection < next_y) {
 						next_y = intersection;
 					}
 				}
 			}
-			Strip strip(y, next_y);
-			for (const RasterizeLine* line: current_lines) {
-				strip.lines.push_back(*line);
+			Strip& strip = buffers.strip;
+			strip.y0 = y;
+			strip.y1 = next_y;
+			strip.lines.clear();
+			for (std::uint32_t line: current_lines) {
+				strip.lines.push_back(RasterizeLine(segments.get_line(line), segments.direction[line], &shapes[segments.shape[line]]));
+			}
+			rasterize_strip(strip, target, clip, buffers.hairlines, buffers.edges, buffers.shapes);
+			y = next_y;
+		}
+		switch (event.type) {
+		case Event::Type::LINE_START:
+			current_lines.push_back(event.index);
+			break;
+		case Event::Type::LINE_END:
+			current_lines.erase(std::find(current_lines.begin(), current_lines.end(), event.index));
+			break;
+		}
+	}
+}
+
+// converts the segments of the visible shapes to fixed point lines clipped to the rectangle. the parts left or right
+// of it are moved onto its vertical edges, which keeps the winding numbers inside and the slopes of the clipped lines.
+// the lines only depend on the vertical edges, the top and bottom of the rectangle only limit the part that is swept,
+// so bands of the same width sweep exactly the same lines
+void get_fixed_lines(const Scene& scene, const std::vector<std::uint32_t>& visible, const Rectangle& rectangle, std::vector<FixedLine>& lines) {
+	const SegmentView segments = scene.get_segments();
+	lines.clear();
+	auto add = [&](float x0, float y0, float x1, float y1, float y_start, float y_end, size_t i) {
+		// lines that are horizontal after snapping are dropped
+		if (to_fixed(y0) != to_fixed(y1) && to_fixed(y_start) < to_fixed(y_end)) {
+			lines.emplace_back(to_fixed(x0), to_fixed(y0), to_fixed(x1), to_fixed(y1), to_fixed(y_start), to_fixed(y_end), segments.direction[i], &scene.shapes[segments.shape[i]]);
+		}
+	};
+	for (std::uint32_t shape: visible) {
+		for (size_t i = scene.shapes[shape].first_segment; i < scene.shapes[shape].last_segment; ++i) {
+			if (std::max(segments.y0[i], rectangle.y0) >= std::min(segments.y1[i], rectangle.y1)) {
+				continue;
+			}
+			const float y0 = std::max(segments.y0[i], -FIXED_RANGE);
+			const float y1 = std::min(segments.y1[i], FIXED_RANGE);
+			const Line line = segments.get_line(i);
+			// the positions at which the line crosses the vertical edges split it into up to three parts
+			float splits[4] = {y0, y1, y1, y1};
+			if (line.m != 0.f) {
+				float s0 = (rectangle.x0 - line.x0) / line.m;
+				float s1 = (rectangle.x1 - line.x0) / line.m;
+				if (s0 > s1) std::swap(s0, s1);
+				splits[1] = clamp(s0, y0, y1);
+				splits[2] = clamp(s1, y0, y1);
+			}
+			for (int j = 0; j < 3; ++j) {
+				const float a = splits[j];
+				const float b = splits[j+1];
+				const float y_start = std::max(a, rectangle.y0);
+				const float y_end = std::min(b, rectangle.y1);
+				if (y_start >= y_end) {
+					continue;
+				}
+				const float x = line.get_x((a + b) * .5f);
+				if (x < rectangle.x0) {
+					add(rectangle.x0, y_start, rectangle.x0, y_end, y_start, y_end, i);
+				}
+				else if (x > rectangle.x1) {
+					add(rectangle.x1, y_start, rectangle.x1, y_end, y_start, y_end, i);
+				}
+				else {
+					add(clamp(line.get_x(a), rectangle.x0, rectangle.x1), a, clamp(line.get_x(b), rectangle.x0, rectangle.x1), b, y_start, y_end, i);
+				}
+			}
+		}
+	}
+}
+
+void sweep_fixed(const Scene& scene, Buffers& buffers, const Target& target, const Rectangle& clip, Budget& budget) {
+	using Event = ::Event<Fixed>;
+	std::vector<FixedLine>& lines = buffers.fixed_lines;
+	std::vector<Event>& events = buffers.fixed_events;
+	{
+		RASTER_TIME(EVENTS);
+		// a margin of a pixel keeps the clipped ends away from the rows that are rendered
+		const Rectangle rectangle(std::max(clip.x0 - 1.f, -FIXED_RANGE), std::max(clip.y0 - 1.f, -FIXED_RANGE), std::min(clip.x1 + 1.f, FIXED_RANGE), std::min(clip.y1 + 1.f, FIXED_RANGE));
+		get_fixed_lines(scene, buffers.visible, rectangle, lines);
+		events.clear();
+		for (size_t i = 0; i < lines.size(); ++i) {
+			events.emplace_back(Event::Type::LINE_START, lines[i].y_start, i);
+			events.emplace_back(Event::Type::LINE_END, lines[i].y_end, i);
+		}
+		std::sort(events.begin(), events.end(), [](const Event& e0, const Event& e1) {
+			return e0.y < e1.y;
+		});
+		RASTER_COUNT(EVENTS, events.size());
+	}
+	budget.estimate_strips(events);
+
+	Fixed y = events.empty() ? 0 : events.front().y;
+	std::vector<const FixedLine*>& current_lines = buffers.current_fixed_lines;
+	current_lines.clear();
+	for (const Event& event: events) {
+		while (y < event.y) {
+			std::sort(current_lines.begin(), current_lines.end(), [y](const FixedLine* l0, const FixedLine* l1) {
+				return l0->less(*l1, y);
+			});
+			budget.start_strip();
+			// find the first position at which adjacent lines change their order
+			Fixed next_y = event.y;
+			for (size_t i = 1; i < current_lines.size(); ++i) {
+				const FixedLine& l0 = *current_lines[i-1];
+				const FixedLine& l1 = *current_lines[i];
+				if (l1.less(l0, next_y)) {
+					Fixed y0 = y;
+					Fixed y1 = next_y;
+					while (y1 - y0 > 1) {
+						const Fixed middle = y0 + (y1 - y0) / 2;
+						if (l1.less(l0, middle)) {
+							y1 = middle;
+						}
+						else {
+							y0 = middle;
+						}
+					}
+					next_y = y1;
+				}
 			}
-			rasterize_strip(strip, pixmap);
+			rasterize_strip(current_lines, y, next_y, target, clip, buffers.hairlines, buffers.steppers, buffers.edges, buffers.shapes);
 			y = next_y;
 		}
 		switch (event.type) {
@@ -226,6 +718,285 @@ void rasterize(const std::vector<Shape>& shapes, const char* file_name, size_t w
 			break;
 		}
 	}
+}
+
+}
+
+void ShapeIndex::build(const std::vector<Shape>& shapes, size_t first, size_t last) {
+	Node node;
+	Rectangle centers;
+	for (size_t i = first; i < last; ++i) {
+		const Rectangle& bounds = shapes[indices[i]].bounds;
+		node.bounds = node.bounds | bounds;
+		centers = centers | Point((bounds.x0 + bounds.x1) * .5f, (bounds.y0 + bounds.y1) * .5f);
+	}
+	if (last - first <= 4) {
+		node.first = first;
+		node.count = last - first;
+		nodes.push_back(node);
+		return;
+	}
+	// split at the median along the longer axis of the centers
+	const size_t middle = first + (last - first) / 2;
+	const bool vertical = centers.y1 - centers.y0 > centers.x1 - centers.x0;
+	std::nth_element(indices.begin() + first, indices.begin() + middle, indices.begin() + last, [&](std::uint32_t i0, std::uint32_t i1) {
+		const Rectangle& b0 = shapes[i0].bounds;
+		const Rectangle& b1 = shapes[i1].bounds;
+		return vertical ? b0.y0 + b0.y1 < b1.y0 + b1.y1 : b0.x0 + b0.x1 < b1.x0 + b1.x1;
+	});
+	const size_t index = nodes.size();
+	node.count = 0;
+	nodes.push_back(node);
+	build(shapes, first, middle);
+	nodes[index].first = nodes.size();
+	build(shapes, middle, last);
+}
+
+void ShapeIndex::build(const std::vector<Shape>& shapes) {
+	nodes.clear();
+	indices.clear();
+	for (size_t i = 0; i < shapes.size(); ++i) {
+		if (!shapes[i].bounds.empty()) {
+			indices.push_back(i);
+		}
+	}
+	if (!indices.empty()) {
+		build(shapes, 0, indices.size());
+	}
+	bounds.clear();
+	for (std::uint32_t i: indices) {
+		bounds.push_back(shapes[i].bounds);
+	}
+	shape_count = shapes.size();
+}
+
+void ShapeIndex::query(const Rectangle& rectangle, std::vector<std::uint32_t>& result) const {
+	const size_t first_result = result.size();
+	// the tree is split at the median, so its depth is at most 32
+	std::uint32_t stack[64];
+	size_t stack_size = 0;
+	if (!nodes.empty()) {
+		stack[stack_size++] = 0;
+	}
+	while (stack_size > 0) {
+		const std::uint32_t index = stack[--stack_size];
+		const Node& node = nodes[index];
+		if (!node.bounds.intersects(rectangle)) {
+			continue;
+		}
+		if (node.count > 0) {
+			for (size_t i = node.first; i < node.first + node.count; ++i) {
+				if (bounds[i].intersects(rectangle)) {
+					result.push_back(indices[i]);
+				}
+			}
+		}
+		else {
+			stack[stack_size++] = node.first;
+			stack[stack_size++] = index + 1;
+		}
+	}
+	std::sort(result.begin() + first_result, result.end());
+}
+
+void Scene::query(const Rectangle& rectangle, std::vector<std::uint32_t>& result) const {
+	if (index.is_valid(shapes.size())) {
+		index.query(rectangle, result);
+		return;
+	}
+	// the index is missing or outdated
+	for (size_t i = 0; i < shapes.size(); ++i) {
+		if (shapes[i].bounds.intersects(rectangle)) {
+			result.push_back(i);
+		}
+	}
+}
+
+int Scene::hit_test(const Point& point) const {
+	const SegmentView segments = get_segments();
+	std::vector<std::uint32_t> candidates;
+	query(Rectangle(point.x, point.y, point.x, point.y), candidates);
+	for (auto i = candidates.rbegin(); i != candidates.rend(); ++i) {
+		const Shape& shape = shapes[*i];
+		// count the segments that cross the horizontal ray to the left of the point
+		int winding = 0;
+		for (size_t j = shape.first_segment; j < shape.last_segment; ++j) {
+			if (segments.y0[j] <= point.y && point.y < segments.y1[j] && segments.get_line(j).get_x(point.y) <= point.x) {
+				winding += segments.direction[j];
+			}
+		}
+		if (winding != 0) {
+			return *i;
+		}
+		for (const Hairline& hairline: shape.hairlines) {
+			// hairlines are thinner than a pixel, they are hit within half a pixel
+			const Point d = hairline.p1 - hairline.p0;
+			const float length_squared = dot(d, d);
+			const float u = length_squared > 0.f ? clamp(dot(point - hairline.p0, d) / length_squared, 0.f, 1.f) : 0.f;
+			const Point e = point - hairline.p0 - d * u;
+			if (dot(e, e) <= .25f) {
+				return *i;
+			}
+		}
+	}
+	return -1;
+}
+
+Rectangle get_viewport_pixels(const Rectangle& viewport) {
+	const float x0 = std::max(std::floor(viewport.x0), 0.f);
+	const float y0 = std::max(std::floor(viewport.y0), 0.f);
+	return Rectangle(x0, y0, std::max(std::ceil(viewport.x1), x0), std::max(std::ceil(viewport.y1), y0));
+}
+
+struct Renderer::Scratch: Buffers {
+	std::atomic<size_t> held_memory{0};
+};
+
+Renderer::Renderer(): scratch(new Scratch()), pixmap(0, 0) {}
+
+Renderer::~Renderer() {}
+
+RenderOptions start_time_limit(const RenderOptions& options) {
+	RenderOptions result = options;
+	if (options.time_limit > 0.f) {
+		const auto time_limit = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(options.time_limit));
+		result.deadline = std::min(options.deadline, std::chrono::steady_clock::now() + time_limit);
+		result.time_limit = 0.f;
+	}
+	return result;
+}
+
+void Renderer::render(const Scene& scene, Pixmap& pixmap, size_t x0, size_t y0, const Rectangle& clip_rectangle, const RenderOptions& render_options) {
+	// round the clip rectangle to whole pixels
+	const Rectangle clip = clip_rectangle & Rectangle(x0, y0, x0 + pixmap.get_width(), y0 + pixmap.get_height());
+	if (clip.empty()) {
+		return;
+	}
+	// callers that render in bands have already turned the time limit into a deadline
+	const RenderOptions options = start_time_limit(render_options);
+	Budget budget(options);
+	budget.check();
+	budget.check_segments(scene.get_segments().size);
+	const Rectangle pixels(std::floor(clip.x0), std::floor(clip.y0), std::ceil(clip.x1), std::ceil(clip.y1));
+	pixmap.clear(pixels.x0 - x0, pixels.y0 - y0, pixels.x1 - x0, pixels.y1 - y0);
+	const Target target(pixmap, x0, y0);
+
+	scratch->visible.clear();
+	scene.query(pixels, scratch->visible);
+	size_t visible_segments = 0;
+	for (std::uint32_t shape: scratch->visible) {
+		visible_segments += scene.shapes[shape].last_segment - scene.shapes[shape].first_segment;
+	}
+	budget.check_events(2 * visible_segments);
+
+	HairlineMap& hairlines = scratch->hairlines;
+	{
+		RASTER_TIME(HAIRLINES);
+		hairlines.reset(pixels);
+		for (std::uint32_t shape: scratch->visible) {
+			hairlines.add(scene.shapes[shape]);
+		}
+		hairlines.finish(target);
+	}
+
+	RASTER_TIME(SWEEP);
+	if (options.fixed_point) {
+		sweep_fixed(scene, *scratch, target, pixels, budget);
+	}
+	else {
+		sweep(scene, *scratch, target, pixels, budget);
+	}
+	peak_memory_usage = std::max(peak_memory_usage, get_memory_usage());
+}
+
+void Renderer::render(const Scene& scene, Pixmap& pixmap, const Rectangle& clip, const RenderOptions& options) {
+	render(scene, pixmap, 0, 0, clip, options);
+}
+
+const Pixmap& Renderer::render(const Scene& scene, const Rectangle& viewport, const RenderOptions& options) {
+	const Rectangle pixels = get_viewport_pixels(viewport);
+	const size_t x0 = pixels.x0;
+	const size_t y0 = pixels.y0;
+	const size_t x1 = pixels.x1;
+	const size_t y1 = pixels.y1;
+	pixmap.resize(x1 - x0, y1 - y0);
+	render(scene, pixmap, x0, y0, Rectangle(x0, y0, x1, y1), options);
+	return pixmap;
+}
+
+const Pixmap& Renderer::render(const Scene& scene, size_t width, size_t height, const RenderOptions& options) {
+	return render(scene, Rectangle(0.f, 0.f, width, height), options);
+}
+
+void Renderer::render(const Scene& scene, const Rectangle& viewport, const RenderOptions& render_options, const std::function<void(const Pixmap&)>& callback) {
+	const RenderOptions options = start_time_limit(render_options);
+	const Rectangle pixels = get_viewport_pixels(viewport);
+	const size_t x0 = pixels.x0;
+	const size_t y0 = pixels.y0;
+	const size_t x1 = pixels.x1;
+	const size_t y1 = pixels.y1;
+	const size_t band_height = get_band_height(scene, Rectangle(x0, y0, x1, y1), options);
+	for (size_t y = y0; y < y1; y += band_height) {
+		callback(render(scene, Rectangle(x0, y, x1, std::min(y + band_height, y1)), options));
+	}
+}
+
+size_t Renderer::get_band_height(const Scene& scene, const Rectangle& viewport, const RenderOptions& options) const {
+	const Rectangle pixels = get_viewport_pixels(viewport);
+	const size_t x0 = pixels.x0;
+	const size_t y0 = pixels.y0;
+	const size_t x1 = pixels.x1;
+	const size_t y1 = pixels.y1;
+	const size_t height = std::max(y1 - y0, static_cast<size_t>(1));
+	if (options.memory_budget == 0) {
+		return height;
+	}
+	const size_t segment_cost = Buffers::get_segment_cost(options.fixed_point);
+	std::vector<std::uint32_t> visible;
+	for (size_t band_height = height; true; band_height = (band_height + 1) / 2) {
+		// the cost of the most expensive band
+		size_t cost = 0;
+		for (size_t y = y0; y < y1 || y == y0; y += band_height) {
+			visible.clear();
+			scene.query(Rectangle(x0, y, x1, std::min(y + band_height, y1)), visible);
+			size_t segments = 0;
+			for (std::uint32_t shape: visible) {
+				segments += scene.shapes[shape].last_segment - scene.shapes[shape].first_segment + scene.shapes[shape].hairlines.size();
+			}
+			cost = std::max(cost, (x1 - x0) * band_height * sizeof(Color) + visible.size() * sizeof(std::uint32_t) + segments * segment_cost);
+		}
+		if (cost <= options.memory_budget) {
+			return band_height;
+		}
+		if (band_height == 1) {
+			throw std::string("the render needs about ") + std::to_string(cost) + " bytes, the memory budget is " + std::to_string(options.memory_budget);
+		}
+	}
+}
+
+void Renderer::hold_memory(size_t bytes) {
+	scratch->held_memory += bytes;
+	peak_memory_usage = std::max(peak_memory_usage, get_memory_usage());
+}
+
+void Renderer::release_memory(size_t bytes) {
+	scratch->held_memory -= bytes;
+}
+
+size_t Renderer::get_memory_usage() const {
+	return scratch->get_memory_usage() + pixmap.get_memory_usage() + scratch->held_memory;
+}
+
+void rasterize(const Scene& scene, Pixmap& pixmap, const Rectangle& clip, const RenderOptions& options) {
+	Renderer renderer;
+	renderer.render(scene, pixmap, clip, options);
+}
+
+void rasterize(const Scene& scene, Pixmap& pixmap, const RenderOptions& options) {
+	rasterize(scene, pixmap, Rectangle(0.f, 0.f, pixmap.get_width(), pixmap.get_height()), options);
+}
 
-	write_png(pixmap, file_name);
+void rasterize(const Scene& scene, const char* file_name, size_t width, size_t height, const RenderOptions& options) {
+	Renderer renderer;
+	write_png(renderer, scene, width, height, options, file_name);
 }
@@ -7,7 +7,14 @@ All rights reserved.
 
 #include <vector>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include "stats.hpp"
 
 constexpr float clamp(float value, float min, float max) {
 	return value < min ? min : (max < value ? max : value);
@@ -37,11 +44,33 @@ constexpr float dot(const Point& p0, const Point& p1) {
 	return p0.x * p1.x + p0.y * p1.y;
 }
 
+struct Rectangle {
+	float x0, y0, x1, y1;
+	constexpr Rectangle(float x0, float y0, float x1, float y1): x0(x0), y0(y0), x1(x1), y1(y1) {}
+	constexpr Rectangle(): Rectangle(std::numeric_limits<float>::infinity(), std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity(), -std::numeric_limits<float>::infinity()) {}
+	constexpr bool empty() const {
+		return !(x0 < x1 && y0 < y1);
+	}
+	constexpr bool intersects(const Rectangle& r) const {
+		return x0 < r.x1 && r.x0 < x1 && y0 < r.y1 && r.y0 < y1;
+	}
+	constexpr Rectangle operator |(const Rectangle& r) const {
+		return Rectangle(x0 < r.x0 ? x0 : r.x0, y0 < r.y0 ? y0 : r.y0, x1 > r.x1 ? x1 : r.x1, y1 > r.y1 ? y1 : r.y1);
+	}
+	constexpr Rectangle operator &(const Rectangle& r) const {
+		return Rectangle(x0 > r.x0 ? x0 : r.x0, y0 > r.y0 ? y0 : r.y0, x1 < r.x1 ? x1 : r.x1, y1 < r.y1 ? y1 : r.y1);
+	}
+	constexpr Rectangle operator |(const Point& p) const {
+		return Rectangle(x0 < p.x ? x0 : p.x, y0 < p.y ? y0 : p.y, x1 > p.x ? x1 : p.x, y1 > p.y ? y1 : p.y);
+	}
+};
+
 struct Line {
 	float m, x0;
 	constexpr Line(float m, const Point& p): m(m), x0(p.x - m * p.y) {}
 	constexpr Line(const Point& p0, const Point& p1): Line((p1.x - p0.x) / (p1.y - p0.y), p0) {}
 	constexpr Line(float x): m(0.f), x0(x) {}
+	constexpr Line(float m, float x0): m(m), x0(x0) {}
 	constexpr float get_x(float y) const {
 		return m * y + x0;
 	}
@@ -51,11 +80,73 @@ constexpr float intersect(const Line& l0, const Line& l1) {
 	return (l1.x0 - l0.x0) / (l0.m - l1.m);
 }
 
-struct Segment {
-	float y0, y1;
-	Line line;
-	constexpr Segment(const Point& p0, const Point& p1): y0(p0.y), y1(p1.y), line(p0, p1) {}
-	constexpr Segment(float y0, float y1, const Line& line): y0(y0), y1(y1), line(line) {}
+// read only access to segments stored as separate arrays
+struct SegmentView {
+	const float* y0 = nullptr;
+	const float* y1 = nullptr;
+	const float* m = nullptr;
+	const float* x0 = nullptr;
+	const std::uint32_t* shape = nullptr;
+	const std::int8_t* direction = nullptr;
+	size_t size = 0;
+	Line get_line(size_t i) const {
+		return Line(m[i], x0[i]);
+	}
+};
+
+// the segments of all shapes stored as separate arrays, y0 < y1 for every segment
+struct SegmentStore {
+	std::vector<float> y0, y1, m, x0;
+	std::vector<std::uint32_t> shape;
+	std::vector<std::int8_t> direction;
+	size_t size() const {
+		return y0.size();
+	}
+	Line get_line(size_t i) const {
+		return Line(m[i], x0[i]);
+	}
+	void append(float y0, float y1, const Line& line, std::uint32_t shape, int direction) {
+		this->y0.push_back(y0);
+		this->y1.push_back(y1);
+		m.push_back(line.m);
+		x0.push_back(line.x0);
+		this->shape.push_back(shape);
+		this->direction.push_back(direction);
+	}
+	void append(const Point& p0, const Point& p1, std::uint32_t shape) {
+		if (p0.y < p1.y) {
+			append(p0.y, p1.y, Line(p0, p1), shape, 1);
+		}
+		else {
+			append(p1.y, p0.y, Line(p0, p1), shape, -1);
+		}
+	}
+	SegmentView view() const {
+		SegmentView view;
+		view.y0 = y0.data();
+		view.y1 = y1.data();
+		view.m = m.data();
+		view.x0 = x0.data();
+		view.shape = shape.data();
+		view.direction = direction.data();
+		view.size = size();
+		return view;
+	}
+	void clear() {
+		y0.clear();
+		y1.clear();
+		m.clear();
+		x0.clear();
+		shape.clear();
+		direction.clear();
+	}
+};
+
+// a line thinner than a pixel that is drawn directly instead of being filled
+struct Hairline {
+	Point p0, p1;
+	float width;
+	constexpr Hairline(const Point& p0, const Point& p1, float width): p0(p0), p1(p1), width(width) {}
 };
 
 struct Color {
@@ -80,19 +171,109 @@ constexpr Color blend(const Color& dst, const Color& src) {
 	return src + dst * (1.f - src.a);
 }
 
+struct CompiledPaint;
+struct PaintTable;
+
 struct Paint {
 	virtual Color evaluate(const Point& point) = 0;
+	// reduces the paint to a record that can be stored in a file, returns false if that is not possible
+	virtual bool compile(PaintTable&, CompiledPaint&) const {
+		return false;
+	}
+};
+
+// a paint as a fixed size record, gradients refer to a lookup table of colors
+struct CompiledPaint {
+	enum class Type: std::uint32_t {
+		COLOR,
+		LINEAR_GRADIENT,
+		RADIAL_GRADIENT
+	};
+	Type type = Type::COLOR;
+	// the first color of the lookup table of a gradient
+	std::uint32_t lut = 0;
+	Color color;
+	float opacity = 1.f;
+	// maps scene coordinates to gradient coordinates (a, b, c, d, e, f)
+	float matrix[6] = {1.f, 0.f, 0.f, 1.f, 0.f, 0.f};
+	// linear gradients: start and end point, radial gradients: center, radius, focal point and focal radius
+	float parameters[6] = {0.f, 0.f, 0.f, 0.f, 0.f, 0.f};
+	Color evaluate(const Color* luts, const Point& point) const;
+};
+
+struct PaintTable {
+	// the number of colors in the lookup table of a gradient
+	static constexpr size_t LUT_SIZE = 256;
+	std::vector<CompiledPaint> paints;
+	std::vector<Color> luts;
 };
 
 struct Shape {
-	std::vector<Segment> segments;
+	// the range of the segments of the shape in the segment store
+	size_t first_segment, last_segment;
+	std::vector<Hairline> hairlines;
 	std::shared_ptr<Paint> paint;
-	Shape(const std::shared_ptr<Paint>& paint): paint(paint) {}
-	void append_segment(const Point& p0, const Point& p1) {
+	Rectangle bounds;
+	Shape(const std::shared_ptr<Paint>& paint, size_t first_segment = 0): first_segment(first_segment), last_segment(first_segment), paint(paint) {}
+	// the shape must be the last one in the store, index is its position in the list of shapes
+	void append_segment(SegmentStore& segments, std::uint32_t index, const Point& p0, const Point& p1) {
 		if (p0.y != p1.y) {
-			segments.emplace_back(p0, p1);
+			segments.append(p0, p1, index);
+			last_segment = segments.size();
+			bounds = bounds | p0 | p1;
 		}
 	}
+	void append_hairline(const Point& p0, const Point& p1, float width) {
+		hairlines.emplace_back(p0, p1, width);
+		bounds = bounds | (p0 - Point(1.f, 1.f)) | (p1 + Point(1.f, 1.f)) | (p0 + Point(1.f, 1.f)) | (p1 - Point(1.f, 1.f));
+	}
+};
+
+// a bounding volume hierarchy over the bounds of shapes
+class ShapeIndex {
+	struct Node {
+		Rectangle bounds;
+		// a leaf refers to count indices starting at first, an inner node has count 0 and its second child at first
+		std::uint32_t first, count;
+	};
+	std::vector<Node> nodes;
+	std::vector<std::uint32_t> indices;
+	// the bounds of the shapes in the order of indices
+	std::vector<Rectangle> bounds;
+	size_t shape_count = 0;
+	void build(const std::vector<Shape>& shapes, size_t first, size_t last);
+public:
+	void build(const std::vector<Shape>& shapes);
+	// whether the index was built for the given number of shapes
+	bool is_valid(size_t shape_count) const {
+		return this->shape_count == shape_count;
+	}
+	// appends the indices of the shapes whose bounds intersect the rectangle in paint order
+	void query(const Rectangle& rectangle, std::vector<std::uint32_t>& result) const;
+};
+
+// the shapes of a document together with their segments and the index over their bounds
+struct Scene {
+	std::vector<Shape> shapes;
+	SegmentStore segments;
+	ShapeIndex index;
+	// segments that are used in place of the store, e.g. from a mapped file, and the memory that keeps them alive
+	SegmentView external_segments;
+	std::shared_ptr<const void> external_memory;
+	SegmentView get_segments() const {
+		return external_memory ? external_segments : segments.view();
+	}
+	// builds the index, called after the last shape was added
+	void finish() {
+		RASTER_TIME(INDEX);
+		RASTER_COUNT(SHAPES, shapes.size());
+		RASTER_COUNT(SEGMENTS, get_segments().size);
+		index.build(shapes);
+	}
+	// appends the indices of the shapes whose bounds intersect the rectangle in paint order
+	void query(const Rectangle& rectangle, std::vector<std::uint32_t>& result) const;
+	// returns the index of the topmost shape under the point or -1, using the nonzero rule for fills
+	int hit_test(const Point& point) const;
 };
 
 class Pixmap {
@@ -104,7 +285,7 @@ public:
 		return width;
 	}
 	size_t get_height() const {
-		return pixels.size() / width;
+		return width > 0 ? pixels.size() / width : 0;
 	}
 	Color get_pixel(size_t x, size_t y) const {
 		size_t i = y * width + x;
@@ -114,6 +295,102 @@ public:
 		size_t i = y * width + x;
 		pixels[i] = pixels[i] + color;
 	}
+	// changes the size, the memory only grows
+	void resize(size_t width, size_t height) {
+		pixels.resize(width * height);
+		this->width = width;
+	}
+	void clear(size_t x0, size_t y0, size_t x1, size_t y1) {
+		for (size_t y = y0; y < y1; ++y) {
+			std::fill(pixels.begin() + y * width + x0, pixels.begin() + y * width + x1, Color());
+		}
+	}
+	size_t get_memory_usage() const {
+		return pixels.capacity() * sizeof(Color);
+	}
+	void multiply(float factor) {
+		for (Color& pixel: pixels) {
+			pixel = pixel * factor;
+		}
+	}
+};
+
+// lets another thread stop the renders that use it
+class CancellationToken {
+	std::atomic<bool> cancelled;
+public:
+	CancellationToken(): cancelled(false) {}
+	void cancel() {
+		cancelled.store(true, std::memory_order_relaxed);
+	}
+	bool is_cancelled() const {
+		return cancelled.load(std::memory_order_relaxed);
+	}
+};
+
+struct RenderOptions {
+	// scale from document units to output pixels
+	float scale = 1.f;
+	// maximum distance between a curve and its flattened segments in output pixels
+	float tolerance = .1f;
+	// subpaths whose bounding box is smaller than this in output pixels are culled
+	float min_size = 0.f;
+	// if positive, points that deviate less than this in output pixels are removed before rasterization
+	float simplify = 0.f;
+	// snap the geometry to 24.8 fixed point and sweep it with integer arithmetic for platform independent results
+	bool fixed_point = false;
+	// a render that is cancelled or runs past its deadline throws an error, both are checked before every strip
+	const CancellationToken* cancellation = nullptr;
+	std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+	// if positive, the number of seconds a render may take in addition to the deadline. it is turned into a deadline once
+	// when the render starts, so all bands of the render share it
+	float time_limit = 0.f;
+	// if positive, renders of more complex scenes throw an error before rasterizing anything
+	size_t max_segments = 0;
+	size_t max_events = 0;
+	size_t max_strips = 0;
+	// if positive, banded renders choose their band height to keep the memory of the renderer under this many bytes
+	size_t memory_budget = 0;
+};
+
+// returns the options with the time limit turned into a deadline from now, called once by every entry point of a render
+RenderOptions start_time_limit(const RenderOptions& options);
+
+// the whole pixels that a viewport covers, without negative coordinates
+Rectangle get_viewport_pixels(const Rectangle& viewport);
+
+// rasterizes scenes, reusing its memory from one render to the next
+class Renderer {
+	struct Scratch;
+	std::unique_ptr<Scratch> scratch;
+	Pixmap pixmap;
+	size_t peak_memory_usage = 0;
+public:
+	Renderer();
+	~Renderer();
+	// x0 and y0 are the position of the top left pixel of the pixmap in the scene
+	void render(const Scene& scene, Pixmap& pixmap, size_t x0, size_t y0, const Rectangle& clip, const RenderOptions& options);
+	// rasterizes the scene into the pixmap, only the pixels inside the clip rectangle are replaced
+	void render(const Scene& scene, Pixmap& pixmap, const Rectangle& clip, const RenderOptions& options = RenderOptions());
+	// rasterizes the part of the scene inside the viewport into a pixmap of the viewport's size, owned by the renderer and valid until the next render
+	const Pixmap& render(const Scene& scene, const Rectangle& viewport, const RenderOptions& options = RenderOptions());
+	const Pixmap& render(const Scene& scene, size_t width, size_t height, const RenderOptions& options = RenderOptions());
+	// rasterizes the viewport in bands of get_band_height() rows and passes them to the callback from top to bottom
+	void render(const Scene& scene, const Rectangle& viewport, const RenderOptions& options, const std::function<void(const Pixmap&)>& callback);
+	// the highest band that is estimated to fit into the memory budget of the options, throws if not even one row fits
+	size_t get_band_height(const Scene& scene, const Rectangle& viewport, const RenderOptions& options) const;
+	// counts memory that the caller keeps for the output of the renderer, like a band that waits to be encoded, in the
+	// usage of the renderer. hold is called by the thread of the renderer, release may be called by any thread
+	void hold_memory(size_t bytes);
+	void release_memory(size_t bytes);
+	// the bytes the renderer holds now and the most it held at the end of any render
+	size_t get_memory_usage() const;
+	size_t get_peak_memory_usage() const {
+		return peak_memory_usage;
+	}
 };
 
-void rasterize(const std::vector<Shape>& shapes, const char* file_name, size_t width, size_t height);
+// rasterizes the shapes into the pixmap, only the pixels inside the clip rectangle are replaced
+void rasterize(const Scene& scene, Pixmap& pixmap, const Rectangle& clip, const RenderOptions& options = RenderOptions());
+void rasterize(const Scene& scene, Pixmap& pixmap, const RenderOptions& options = RenderOptions());
+void rasterize(const Scene& scene, const char* file_name, size_t width, size_t height, const RenderOptions& options = RenderOptions());
@@ -0,0 +1,274 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "document.hpp"
+#include "scene.hpp"
+#include <map>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The file starts with a header followed by sections at the offsets given in the header, each
+// aligned to 8 bytes. All values are stored in the byte order of the machine that wrote the file.
+//   segments: y0, y1, m, x0 (float arrays), shape (uint32 array), direction (int8 array)
+//   shapes: ShapeRecord array
+//   hairlines: Hairline array
+//   paints: CompiledPaint array
+//   luts: Color array
+
+namespace {
+
+constexpr char MAGIC[8] = {'R', 'A', 'S', 'T', 'E', 'R', 'S', 'C'};
+constexpr std::uint32_t VERSION = 1;
+constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct Header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t byte_order;
+	float width, height;
+	std::uint64_t segment_count, shape_count, hairline_count, paint_count, lut_size;
+	std::uint64_t y0, y1, m, x0, shape, direction;
+	std::uint64_t shapes, hairlines, paints, luts;
+};
+
+struct ShapeRecord {
+	std::uint32_t first_segment, last_segment;
+	std::uint32_t first_hairline, last_hairline;
+	std::uint32_t paint;
+	float x0, y0, x1, y1;
+};
+
+class Writer {
+	std::ofstream file;
+	std::uint64_t position = 0;
+public:
+	Writer(const char* file_name): file(file_name, std::ios::binary) {
+		if (!file) {
+			throw std::string("could not open ") + file_name;
+		}
+	}
+	// writes the array aligned to 8 bytes and returns its offset
+	template <class T> std::uint64_t write(const T* data, size_t count) {
+		static const char padding[8] = {};
+		const size_t padding_size = (8 - position % 8) % 8;
+		file.write(padding, padding_size);
+		position += padding_size;
+		const std::uint64_t offset = position;
+		file.write(reinterpret_cast<const char*>(data), count * sizeof(T));
+		position += count * sizeof(T);
+		return offset;
+	}
+	void write_header(const Header& header) {
+		file.seekp(0);
+		file.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+		if (!file) {
+			throw std::string("could not write the scene");
+		}
+	}
+};
+
+// a paint that evaluates a compiled record in the mapped file
+class MappedPaint: public Paint {
+	const CompiledPaint* paint;
+	const Color* luts;
+	std::shared_ptr<const void> memory;
+public:
+	MappedPaint(const CompiledPaint* paint, const Color* luts, const std::shared_ptr<const void>& memory): paint(paint), luts(luts), memory(memory) {}
+	Color evaluate(const Point& point) override {
+		return paint->evaluate(luts, point);
+	}
+	bool compile(PaintTable& table, CompiledPaint& paint) const override {
+		paint = *this->paint;
+		if (paint.type != CompiledPaint::Type::COLOR) {
+			paint.lut = table.luts.size();
+			table.luts.insert(table.luts.end(), luts + this->paint->lut, luts + this->paint->lut + PaintTable::LUT_SIZE);
+		}
+		return true;
+	}
+};
+
+template <class T> const T* get_array(const char* data, size_t size, std::uint64_t offset, std::uint64_t count) {
+	if (offset % alignof(T) != 0 || offset > size || count > (size - offset) / sizeof(T)) {
+		throw std::string("invalid scene file");
+	}
+	return reinterpret_cast<const T*>(data + offset);
+}
+
+}
+
+Color CompiledPaint::evaluate(const Color* luts, const Point& p) const {
+	if (type == Type::COLOR) {
+		return color * opacity;
+	}
+	const Point q(matrix[0] * p.x + matrix[2] * p.y + matrix[4], matrix[1] * p.x + matrix[3] * p.y + matrix[5]);
+	const float* a = parameters;
+	float t;
+	if (type == Type::LINEAR_GRADIENT) {
+		const Point d(a[2] - a[0], a[3] - a[1]);
+		t = dot(q - Point(a[0], a[1]), d) / dot(d, d);
+	}
+	else {
+		// the same equation as in RadialGradient::evaluate
+		const Point c(a[0], a[1]);
+		const float r = a[2];
+		const Point f(a[3], a[4]);
+		const float fr = a[5];
+		const float A = dot(c - f, c - f) - (r - fr) * (r - fr);
+		const float B = dot(c - f, f - q) - fr * (r - fr);
+		const float C = dot(f - q, f - q) - fr * fr;
+		if (A == 0.f) {
+			if (B == 0.f) {
+				return Color();
+			}
+			t = -C / (2.f * B);
+		}
+		else {
+			const float D = B * B - A * C;
+			if (D < 0.f) {
+				return Color();
+			}
+			t = fr > r ? (-B + std::sqrt(D)) / A : (-B - std::sqrt(D)) / A;
+		}
+	}
+	const size_t i = clamp(t * (PaintTable::LUT_SIZE - 1) + .5f, 0.f, PaintTable::LUT_SIZE - 1);
+	return luts[lut + i] * opacity;
+}
+
+void write_scene(const Document& document, const char* file_name) {
+	const SegmentView segments = document.get_segments();
+	PaintTable table;
+	std::map<const Paint*, std::uint32_t> paint_indices;
+	std::vector<ShapeRecord> shapes;
+	std::vector<Hairline> hairlines;
+	for (const Shape& shape: document.shapes) {
+		auto i = paint_indices.find(shape.paint.get());
+		if (i == paint_indices.end()) {
+			CompiledPaint paint;
+			if (!shape.paint->compile(table, paint)) {
+				throw std::string("the paint of a shape cannot be compiled");
+			}
+			i = paint_indices.insert(std::make_pair(shape.paint.get(), table.paints.size())).first;
+			table.paints.push_back(paint);
+		}
+		ShapeRecord record;
+		record.first_segment = shape.first_segment;
+		record.last_segment = shape.last_segment;
+		record.first_hairline = hairlines.size();
+		hairlines.insert(hairlines.end(), shape.hairlines.begin(), shape.hairlines.end());
+		record.last_hairline = hairlines.size();
+		record.paint = i->second;
+		record.x0 = shape.bounds.x0;
+		record.y0 = shape.bounds.y0;
+		record.x1 = shape.bounds.x1;
+		record.y1 = shape.bounds.y1;
+		shapes.push_back(record);
+	}
+
+	Header header;
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.version = VERSION;
+	header.byte_order = BYTE_ORDER_MARK;
+	header.width = document.width;
+	header.height = document.height;
+	header.segment_count = segments.size;
+	header.shape_count = shapes.size();
+	header.hairline_count = hairlines.size();
+	header.paint_count = table.paints.size();
+	header.lut_size = table.luts.size();
+	Writer writer(file_name);
+	// reserve the space for the header, it is written last
+	writer.write(&header, 1);
+	header.y0 = writer.write(segments.y0, segments.size);
+	header.y1 = writer.write(segments.y1, segments.size);
+	header.m = writer.write(segments.m, segments.size);
+	header.x0 = writer.write(segments.x0, segments.size);
+	header.shape = writer.write(segments.shape, segments.size);
+	header.direction = writer.write(segments.direction, segments.size);
+	header.shapes = writer.write(shapes.data(), shapes.size());
+	header.hairlines = writer.write(hairlines.data(), hairlines.size());
+	header.paints = writer.write(table.paints.data(), table.paints.size());
+	header.luts = writer.write(table.luts.data(), table.luts.size());
+	writer.write_header(header);
+}
+
+Document read_scene(const char* file_name) {
+	const int fd = open(file_name, O_RDONLY);
+	if (fd < 0) {
+		throw std::string("could not open ") + file_name;
+	}
+	struct stat status;
+	if (fstat(fd, &status) < 0 || static_cast<size_t>(status.st_size) < sizeof(Header)) {
+		close(fd);
+		throw std::string("invalid scene file");
+	}
+	const size_t size = status.st_size;
+	void* address = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (address == MAP_FAILED) {
+		throw std::string("could not map ") + file_name;
+	}
+	std::shared_ptr<const void> memory(address, [size](const void* address) {
+		munmap(const_cast<void*>(address), size);
+	});
+	const char* data = static_cast<const char*>(address);
+	const Header& header = *reinterpret_cast<const Header*>(data);
+	if (std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.byte_order != BYTE_ORDER_MARK) {
+		throw std::string("invalid scene file");
+	}
+	if (header.version != VERSION) {
+		throw std::string("unsupported scene file version ") + std::to_string(header.version);
+	}
+
+	Document document;
+	document.width = header.width;
+	document.height = header.height;
+	SegmentView& segments = document.external_segments;
+	segments.y0 = get_array<float>(data, size, header.y0, header.segment_count);
+	segments.y1 = get_array<float>(data, size, header.y1, header.segment_count);
+	segments.m = get_array<float>(data, size, header.m, header.segment_count);
+	segments.x0 = get_array<float>(data, size, header.x0, header.segment_count);
+	segments.shape = get_array<std::uint32_t>(data, size, header.shape, header.segment_count);
+	segments.direction = get_array<std::int8_t>(data, size, header.direction, header.segment_count);
+	segments.size = header.segment_count;
+	document.external_memory = memory;
+	const ShapeRecord* shapes = get_array<ShapeRecord>(data, size, header.shapes, header.shape_count);
+	const Hairline* hairlines = get_array<Hairline>(data, size, header.hairlines, header.hairline_count);
+	const CompiledPaint* paints = get_array<CompiledPaint>(data, size, header.paints, header.paint_count);
+	const Color* luts = get_array<Color>(data, size, header.luts, header.lut_size);
+
+	std::vector<std::shared_ptr<Paint>> mapped_paints;
+	for (size_t i = 0; i < header.paint_count; ++i) {
+		if (paints[i].type != CompiledPaint::Type::COLOR && paints[i].lut + PaintTable::LUT_SIZE > header.lut_size) {
+			throw std::string("invalid scene file");
+		}
+		mapped_paints.push_back(std::make_shared<MappedPaint>(&paints[i], luts, memory));
+	}
+	for (size_t i = 0; i < header.segment_count; ++i) {
+		if (segments.shape[i] >= header.shape_count) {
+			throw std::string("invalid scene file");
+		}
+	}
+	document.shapes.reserve(header.shape_count);
+	for (size_t i = 0; i < header.shape_count; ++i) {
+		const ShapeRecord& record = shapes[i];
+		if (record.paint >= header.paint_count || record.first_segment > record.last_segment || record.last_segment > header.segment_count || record.first_hairline > record.last_hairline || record.last_hairline > header.hairline_count) {
+			throw std::string("invalid scene file");
+		}
+		document.shapes.emplace_back(mapped_paints[record.paint], record.first_segment);
+		Shape& shape = document.shapes.back();
+		shape.last_segment = record.last_segment;
+		shape.hairlines.assign(hairlines + record.first_hairline, hairlines + record.last_hairline);
+		shape.bounds = Rectangle(record.x0, record.y0, record.x1, record.y1);
+	}
+	document.finish();
+	return document;
+}
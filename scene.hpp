@@ -0,0 +1,12 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+// writes the flattened document to a binary file that can be rendered without parsing the SVG again
+void write_scene(const Document& document, const char* file_name);
+
+// maps a file written by write_scene, the segments are rendered directly from the mapped memory
+Document read_scene(const char* file_name);
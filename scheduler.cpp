@@ -0,0 +1,131 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "scheduler.hpp"
+
+namespace {
+
+// the scheduler and index of the worker running on this thread
+thread_local const Scheduler* current_scheduler = nullptr;
+thread_local size_t current_index = 0;
+
+}
+
+Scheduler::Scheduler(size_t thread_count): queued(0), next_worker(0) {
+	for (size_t i = 0; i < std::max(thread_count, static_cast<size_t>(1)); ++i) {
+		workers.emplace_back(new Worker());
+	}
+	for (size_t i = 1; i < workers.size(); ++i) {
+		threads.emplace_back(&Scheduler::work, this, i);
+	}
+}
+
+Scheduler::~Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+	}
+	sleep_condition.notify_all();
+	for (std::thread& thread: threads) {
+		thread.join();
+	}
+}
+
+size_t Scheduler::get_thread_index() const {
+	return current_scheduler == this ? current_index : 0;
+}
+
+void Scheduler::submit(TaskGroup& group, std::function<void()> task) {
+	++group.pending;
+	// tasks submitted by a worker go to its own deque, tasks of other threads are distributed
+	const size_t index = current_scheduler == this ? current_index : next_worker++ % workers.size();
+	{
+		std::lock_guard<std::mutex> lock(workers[index]->mutex);
+		workers[index]->tasks.push_back(Task {std::move(task), &group});
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		++queued;
+	}
+	sleep_condition.notify_one();
+}
+
+bool Scheduler::run_task(size_t index) {
+	Task task;
+	bool found = false;
+	for (size_t i = 0; i < workers.size() && !found; ++i) {
+		Worker& worker = *workers[(index + i) % workers.size()];
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		if (!worker.tasks.empty()) {
+			if (i == 0) {
+				task = std::move(worker.tasks.back());
+				worker.tasks.pop_back();
+			}
+			else {
+				task = std::move(worker.tasks.front());
+				worker.tasks.pop_front();
+			}
+			found = true;
+		}
+	}
+	if (!found) {
+		return false;
+	}
+	--queued;
+	TaskGroup& group = *task.group;
+	// the remaining tasks of a failed group are skipped
+	if (!group.failed) {
+		try {
+			task.function();
+		} catch (...) {
+			bool expected = false;
+			if (group.failed.compare_exchange_strong(expected, true)) {
+				group.error = std::current_exception();
+			}
+		}
+	}
+	if (--group.pending == 0) {
+		// wake the threads that wait for the group
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		sleep_condition.notify_all();
+	}
+	return true;
+}
+
+void Scheduler::work(size_t index) {
+	current_scheduler = this;
+	current_index = index;
+	while (true) {
+		if (run_task(index)) {
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleep_condition.wait(lock, [this]() {
+			return stopping || queued > 0;
+		});
+		if (stopping) {
+			return;
+		}
+	}
+}
+
+void Scheduler::wait(TaskGroup& group) {
+	const size_t index = get_thread_index();
+	while (group.pending > 0) {
+		if (run_task(index)) {
+			continue;
+		}
+		// the remaining tasks of the group are running on other threads
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		sleep_condition.wait(lock, [this, &group]() {
+			return queued > 0 || group.pending == 0;
+		});
+	}
+	if (group.failed) {
+		std::rethrow_exception(group.error);
+	}
+}
@@ -0,0 +1,74 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include <functional>
+#include <vector>
+#include <deque>
+#include <string>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+// a set of tasks that can be waited for, the first exception thrown by a task is thrown again by Scheduler::wait
+class TaskGroup {
+	friend class Scheduler;
+	std::atomic<size_t> pending;
+	std::atomic<bool> failed;
+	std::exception_ptr error;
+public:
+	TaskGroup(): pending(0), failed(false) {}
+};
+
+// runs tasks on a fixed number of threads. every worker has its own deque, it runs its newest task first and steals the
+// oldest tasks of the other workers when its deque is empty. the thread that waits for a group runs tasks as well, so
+// tasks may submit and wait for other tasks
+class Scheduler {
+	struct Task {
+		std::function<void()> function;
+		TaskGroup* group;
+	};
+	struct Worker {
+		std::mutex mutex;
+		std::deque<Task> tasks;
+	};
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::vector<std::thread> threads;
+	std::atomic<size_t> queued;
+	std::atomic<size_t> next_worker;
+	std::mutex sleep_mutex;
+	std::condition_variable sleep_condition;
+	bool stopping = false;
+	bool run_task(size_t index);
+	void work(size_t index);
+public:
+	// the calling thread counts as one of the threads, so a thread count of 1 runs all tasks while waiting
+	explicit Scheduler(size_t thread_count);
+	~Scheduler();
+	size_t get_thread_count() const {
+		return workers.size();
+	}
+	// the index of the calling thread, from 1 for the workers and 0 for any other thread
+	size_t get_thread_index() const;
+	void submit(TaskGroup& group, std::function<void()> task);
+	// runs tasks until all tasks of the group are done, sleeps while there are no tasks to run
+	void wait(TaskGroup& group);
+};
+
+// calls f(i) for every i below count and waits for all calls. the calls are submitted in reverse, so a thread that runs
+// its own tasks newest first starts with the lowest indices and other threads steal the highest ones
+template <class F> void parallel_for(Scheduler& scheduler, size_t count, F f) {
+	TaskGroup group;
+	for (size_t i = count; i-- > 0;) {
+		scheduler.submit(group, [&f, i]() {
+			f(i);
+		});
+	}
+	scheduler.wait(group);
+}
@@ -0,0 +1,276 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "parser.hpp"
+#include "scheduler.hpp"
+#include "png.hpp"
+#include "server.hpp"
+#include <list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <exception>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+class Socket {
+	int fd;
+	char buffer[4096];
+	size_t buffer_start = 0;
+	size_t buffer_end = 0;
+	[[noreturn]] static void error(const std::string& message) {
+		throw message + ": " + std::strerror(errno);
+	}
+	// returns false at the end of the stream
+	bool fill() {
+		ssize_t n;
+		do {
+			n = ::read(fd, buffer, sizeof(buffer));
+		} while (n < 0 && errno == EINTR);
+		if (n < 0) error("read");
+		buffer_start = 0;
+		buffer_end = n;
+		return n > 0;
+	}
+public:
+	explicit Socket(int fd): fd(fd) {}
+	Socket(const Socket&) = delete;
+	Socket& operator =(const Socket&) = delete;
+	~Socket() {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+	static sockaddr_un get_address(const char* path) {
+		sockaddr_un address;
+		std::memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if (std::strlen(path) >= sizeof(address.sun_path)) {
+			throw std::string("socket path too long");
+		}
+		std::strcpy(address.sun_path, path);
+		return address;
+	}
+	static std::unique_ptr<Socket> listen(const char* path) {
+		std::unique_ptr<Socket> socket(new Socket(::socket(AF_UNIX, SOCK_STREAM, 0)));
+		if (socket->fd < 0) error("socket");
+		const sockaddr_un address = get_address(path);
+		unlink(path);
+		if (bind(socket->fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) error("bind");
+		if (::listen(socket->fd, 16) < 0) error("listen");
+		return socket;
+	}
+	static std::unique_ptr<Socket> connect(const char* path) {
+		std::unique_ptr<Socket> socket(new Socket(::socket(AF_UNIX, SOCK_STREAM, 0)));
+		if (socket->fd < 0) error("socket");
+		const sockaddr_un address = get_address(path);
+		if (::connect(socket->fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0) error("connect");
+		return socket;
+	}
+	std::unique_ptr<Socket> accept() {
+		int client;
+		do {
+			client = ::accept(fd, nullptr, nullptr);
+		} while (client < 0 && errno == EINTR);
+		if (client < 0) error("accept");
+		return std::unique_ptr<Socket>(new Socket(client));
+	}
+	// reads a line without its line break, returns false at the end of the stream
+	bool read_line(std::string& line) {
+		line.clear();
+		while (true) {
+			if (buffer_start == buffer_end && !fill()) {
+				if (line.empty()) {
+					return false;
+				}
+				throw std::string("unexpected end of stream");
+			}
+			const char* start = buffer + buffer_start;
+			const char* end = static_cast<const char*>(std::memchr(start, '\n', buffer_end - buffer_start));
+			if (end) {
+				line.append(start, end - start);
+				buffer_start += end - start + 1;
+				return true;
+			}
+			line.append(start, buffer_end - buffer_start);
+			buffer_start = buffer_end;
+		}
+	}
+	std::string read(size_t length) {
+		std::string result;
+		while (result.size() < length) {
+			if (buffer_start == buffer_end && !fill()) {
+				throw std::string("unexpected end of stream");
+			}
+			const size_t n = std::min(length - result.size(), buffer_end - buffer_start);
+			result.append(buffer + buffer_start, n);
+			buffer_start += n;
+		}
+		return result;
+	}
+	void write(const std::string& data) {
+		size_t written = 0;
+		while (written < data.size()) {
+			const ssize_t n = send(fd, data.data() + written, data.size() - written, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				error("write");
+			}
+			written += n;
+		}
+	}
+};
+
+// FNV-1a
+std::uint64_t hash(const std::string& s) {
+	std::uint64_t h = 14695981039346656037u;
+	for (char c: s) {
+		h = (h ^ static_cast<unsigned char>(c)) * 1099511628211u;
+	}
+	return h;
+}
+
+std::string read_file(const std::string& file_name) {
+	std::ifstream file(file_name, std::ios::binary);
+	if (!file) {
+		throw "could not open " + file_name;
+	}
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// parsed documents by the hash of their content and the scale they were parsed with
+class DocumentCache {
+	using Key = std::pair<std::uint64_t, float>;
+	using Entry = std::pair<Key, Document>;
+	std::list<Entry> entries;
+	std::map<Key, std::list<Entry>::iterator> index;
+	size_t capacity;
+public:
+	DocumentCache(size_t capacity): capacity(capacity) {}
+	const Document& get(const std::string& svg, const RenderOptions& options) {
+		const Key key(hash(svg), options.scale);
+		auto i = index.find(key);
+		if (i != index.end()) {
+			// move the entry to the front
+			entries.splice(entries.begin(), entries, i->second);
+			return i->second->second;
+		}
+		entries.emplace_front(key, parse(svg, options));
+		index[key] = entries.begin();
+		while (entries.size() > capacity && entries.size() > 1) {
+			index.erase(entries.back().first);
+			entries.pop_back();
+		}
+		return entries.front().second;
+	}
+};
+
+std::string render(const RenderRequest& request, DocumentCache& cache, Scheduler& scheduler, std::vector<Renderer>& renderers, RenderOptions options, const ServerLimits& limits) {
+	options.scale *= request.scale;
+	// the time limit covers the whole request, not every band on its own
+	options = start_time_limit(options);
+	const std::string svg = request.is_path ? read_file(request.source) : request.source;
+	const Document& document = cache.get(svg, options);
+	const float x1 = request.width > 0.f ? request.x + request.width : document.width;
+	const float y1 = request.height > 0.f ? request.y + request.height : document.height;
+	ImageWriter::Format format;
+	if (request.format == "png") {
+		format = ImageWriter::Format::PNG;
+	}
+	else if (request.format == "rgba") {
+		format = ImageWriter::Format::RGBA;
+	}
+	else {
+		throw "unknown format " + request.format;
+	}
+	// only the encoded 8 bit image is kept in full, the renderer holds one band at a time
+	const Rectangle viewport(request.x, request.y, x1, y1);
+	const Rectangle pixels = get_viewport_pixels(viewport);
+	const size_t width = pixels.x1 - pixels.x0;
+	const size_t height = pixels.y1 - pixels.y0;
+	if (width > 0 && height > limits.max_pixels / width) {
+		throw "the image has " + std::to_string(width) + " by " + std::to_string(height) + " pixels, at most " + std::to_string(limits.max_pixels) + " are allowed";
+	}
+	std::ostringstream stream;
+	ImageWriter writer(stream, format, width, height);
+	write_image(scheduler, renderers, document, viewport, options, writer);
+	return stream.str();
+}
+
+void serve_client(Socket& client, DocumentCache& cache, Scheduler& scheduler, std::vector<Renderer>& renderers, const RenderOptions& options, const ServerLimits& limits) {
+	std::string line;
+	while (client.read_line(line)) {
+		std::istringstream header(line);
+		std::string command, source;
+		RenderRequest request;
+		size_t length = 0;
+		header >> command >> request.scale >> request.x >> request.y >> request.width >> request.height >> request.format >> source >> length;
+		if (!header || command != "render" || (source != "svg" && source != "path")) {
+			client.write("error invalid request\n");
+			return;
+		}
+		if (length > limits.max_request_size) {
+			// the payload is not read, so the rest of the stream cannot be parsed
+			client.write("error the request has " + std::to_string(length) + " bytes, at most " + std::to_string(limits.max_request_size) + " are allowed\n");
+			return;
+		}
+		request.is_path = source == "path";
+		request.source = client.read(length);
+		try {
+			const std::string image = render(request, cache, scheduler, renderers, options, limits);
+			client.write("ok " + std::to_string(image.size()) + "\n" + image);
+		} catch (const std::string& error) {
+			client.write("error " + error + "\n");
+		} catch (const std::exception& error) {
+			client.write(std::string("error ") + error.what() + "\n");
+		} catch (...) {
+			client.write("error unknown error\n");
+		}
+	}
+}
+
+}
+
+void serve(const char* socket_path, size_t cache_size, size_t thread_count, const RenderOptions& options, const ServerLimits& limits) {
+	std::unique_ptr<Socket> socket = Socket::listen(socket_path);
+	DocumentCache cache(cache_size);
+	Scheduler scheduler(thread_count);
+	std::vector<Renderer> renderers(scheduler.get_thread_count());
+	while (true) {
+		std::unique_ptr<Socket> client = socket->accept();
+		try {
+			serve_client(*client, cache, scheduler, renderers, options, limits);
+		} catch (const std::string& error) {
+			// a broken connection only affects its client
+			std::cerr << "error: " << error << std::endl;
+		} catch (const std::exception& error) {
+			std::cerr << "error: " << error.what() << std::endl;
+		}
+	}
+}
+
+std::string send_request(const char* socket_path, const RenderRequest& request) {
+	std::unique_ptr<Socket> socket = Socket::connect(socket_path);
+	std::ostringstream header;
+	header << "render " << request.scale << " " << request.x << " " << request.y << " " << request.width << " " << request.height << " " << request.format << " " << (request.is_path ? "path" : "svg") << " " << request.source.size() << "\n";
+	socket->write(header.str() + request.source);
+	std::string line;
+	if (!socket->read_line(line)) {
+		throw std::string("no response");
+	}
+	if (line.compare(0, 3, "ok ") != 0) {
+		throw line.compare(0, 6, "error ") == 0 ? line.substr(6) : "invalid response";
+	}
+	return socket->read(std::stoul(line.substr(3)));
+}
@@ -0,0 +1,43 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include <string>
+
+// A client sends any number of requests over one connection. Every request is a header line
+//   render <scale> <x> <y> <width> <height> <format> <source> <length>
+// followed by length bytes that are either the SVG document itself (source svg) or the path of
+// an SVG file on the server (source path). The viewport x, y, width, height is given in output
+// pixels, a width or height of 0 extends it to the edge of the document. The format is png or
+// rgba. The server answers with
+//   ok <length>
+// followed by the image, or with
+//   error <message>
+
+struct RenderRequest {
+	float scale = 1.f;
+	// the viewport in output pixels
+	float x = 0.f, y = 0.f, width = 0.f, height = 0.f;
+	std::string format = "png";
+	// either the path of an SVG file or the document itself
+	bool is_path = false;
+	std::string source;
+};
+
+// requests beyond these limits are answered with an error before anything is allocated for them
+struct ServerLimits {
+	// the longest document or path a request may send, a longer one also closes the connection
+	size_t max_request_size = 64 << 20;
+	// the most pixels of a requested image
+	size_t max_pixels = 1 << 28;
+};
+
+// listens on the socket and keeps up to cache_size parsed documents, the least recently used one is dropped first.
+// the bands of every request are rendered on thread_count threads
+void serve(const char* socket_path, size_t cache_size, size_t thread_count, const RenderOptions& options, const ServerLimits& limits = ServerLimits());
+
+// sends a request to the server listening on the socket and returns the image
+std::string send_request(const char* socket_path, const RenderRequest& request);
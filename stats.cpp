@@ -0,0 +1,192 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "stats.hpp"
+
+#ifdef RASTER_STATS
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
+
+namespace {
+
+constexpr int COUNTERS = static_cast<int>(Counter::COUNT);
+constexpr int TIMERS = static_cast<int>(Timer::COUNT);
+
+const char* counter_names[COUNTERS] = {"shapes", "segments", "events", "strips", "trapezoids", "pixels", "paint_evaluations", "bytes_written"};
+const char* timer_names[TIMERS] = {"read", "parse", "flatten", "index", "hairlines", "events", "sweep", "encode"};
+
+struct Totals {
+	std::uint64_t counters[COUNTERS] = {};
+	std::uint64_t nanoseconds[TIMERS] = {};
+	void add(const stats::ThreadStats& thread) {
+		for (int i = 0; i < COUNTERS; ++i) {
+			counters[i] += thread.counters[i].load(std::memory_order_relaxed);
+		}
+		for (int i = 0; i < TIMERS; ++i) {
+			nanoseconds[i] += thread.nanoseconds[i].load(std::memory_order_relaxed);
+		}
+	}
+};
+
+// the threads that are still running and the totals of the threads that have already exited
+struct Registry {
+	std::mutex mutex;
+	std::vector<stats::ThreadStats*> threads;
+	Totals exited;
+};
+
+Registry& get_registry() {
+	static Registry* registry = new Registry();
+	return *registry;
+}
+
+struct TraceEvent {
+	const char* name;
+	std::int64_t begin, end;
+};
+
+// the spans of one thread in a list of chunks. only the owning thread appends and it publishes the new size with a
+// release store, so the trace can be written at any time without a lock. the buffers outlive their threads
+struct TraceBuffer {
+	static constexpr size_t CHUNK_SIZE = 4096;
+	struct Chunk {
+		TraceEvent events[CHUNK_SIZE];
+		std::atomic<size_t> size;
+		std::atomic<Chunk*> next;
+		Chunk(): size(0), next(nullptr) {}
+	};
+	size_t thread;
+	Chunk* first;
+	Chunk* last;
+	TraceBuffer* next;
+	TraceBuffer(size_t thread): thread(thread), first(new Chunk()), last(first), next(nullptr) {}
+	void append(const TraceEvent& event) {
+		size_t size = last->size.load(std::memory_order_relaxed);
+		if (size == CHUNK_SIZE) {
+			Chunk* chunk = new Chunk();
+			last->next.store(chunk, std::memory_order_release);
+			last = chunk;
+			size = 0;
+		}
+		last->events[size] = event;
+		last->size.store(size + 1, std::memory_order_release);
+	}
+};
+
+std::chrono::steady_clock::time_point trace_start;
+std::atomic<TraceBuffer*> trace_buffers(nullptr);
+std::atomic<size_t> trace_threads(0);
+thread_local TraceBuffer* trace_buffer = nullptr;
+
+std::int64_t get_trace_time(std::chrono::steady_clock::time_point time) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(time - trace_start).count();
+}
+
+}
+
+namespace stats {
+
+thread_local ThreadStats thread_stats;
+thread_local ScopedTimer* current_timer = nullptr;
+
+ThreadStats::ThreadStats() {
+	for (auto& counter: counters) {
+		counter.store(0, std::memory_order_relaxed);
+	}
+	for (auto& value: nanoseconds) {
+		value.store(0, std::memory_order_relaxed);
+	}
+	Registry& registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.threads.push_back(this);
+}
+
+ThreadStats::~ThreadStats() {
+	Registry& registry = get_registry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+	registry.exited.add(*this);
+	registry.threads.erase(std::find(registry.threads.begin(), registry.threads.end(), this));
+}
+
+std::atomic<bool> tracing(false);
+
+const char* get_name(Timer timer) {
+	return timer_names[static_cast<int>(timer)];
+}
+
+void trace(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end) {
+	if (!trace_buffer) {
+		// the buffer is pushed to the front of the list of all buffers
+		trace_buffer = new TraceBuffer(trace_threads.fetch_add(1));
+		TraceBuffer* head = trace_buffers.load(std::memory_order_relaxed);
+		do {
+			trace_buffer->next = head;
+		} while (!trace_buffers.compare_exchange_weak(head, trace_buffer, std::memory_order_release, std::memory_order_relaxed));
+	}
+	trace_buffer->append(TraceEvent{name, get_trace_time(begin), get_trace_time(end)});
+}
+
+void start_tracing() {
+	trace_start = std::chrono::steady_clock::now();
+	tracing.store(true);
+}
+
+bool write_trace(const char* file_name) {
+	std::ofstream file(file_name);
+	if (!file) {
+		return false;
+	}
+	// the timestamps are in microseconds, every span becomes a complete event with its duration
+	file << std::fixed << std::setprecision(3);
+	file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	bool first = true;
+	for (const TraceBuffer* buffer = trace_buffers.load(std::memory_order_acquire); buffer; buffer = buffer->next) {
+		file << (first ? "\n" : ",\n") << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->thread << ", \"args\": {\"name\": \"thread " << buffer->thread << "\"}}";
+		first = false;
+		for (const TraceBuffer::Chunk* chunk = buffer->first; chunk; chunk = chunk->next.load(std::memory_order_acquire)) {
+			const size_t size = chunk->size.load(std::memory_order_acquire);
+			for (size_t i = 0; i < size; ++i) {
+				const TraceEvent& event = chunk->events[i];
+				file << ",\n{\"name\": \"" << event.name << "\", \"ph\": \"X\", \"ts\": " << event.begin / 1e3 << ", \"dur\": " << (event.end - event.begin) / 1e3 << ", \"pid\": 1, \"tid\": " << buffer->thread << "}";
+			}
+		}
+	}
+	file << "\n]}\n";
+	return static_cast<bool>(file);
+}
+
+std::string get_json(double wall_seconds) {
+	Totals totals;
+	{
+		Registry& registry = get_registry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		totals = registry.exited;
+		for (const ThreadStats* thread: registry.threads) {
+			totals.add(*thread);
+		}
+	}
+	std::ostringstream json;
+	json << "{\"wall_ms\": " << wall_seconds * 1000.0 << ", \"stages_ms\": {";
+	for (int i = 0; i < TIMERS; ++i) {
+		json << (i > 0 ? ", " : "") << '"' << timer_names[i] << "\": " << totals.nanoseconds[i] / 1e6;
+	}
+	json << "}, \"counters\": {";
+	for (int i = 0; i < COUNTERS; ++i) {
+		json << (i > 0 ? ", " : "") << '"' << counter_names[i] << "\": " << totals.counters[i];
+	}
+	json << "}}";
+	return json.str();
+}
+
+}
+
+#endif
@@ -0,0 +1,138 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include <cstdint>
+#include <string>
+
+// the counters and stage timers behind --stats. every thread counts into its own slots without locking, the totals are
+// only read once the work is done. the stage times are exclusive, a stage that runs inside another one like flattening
+// during parsing is only counted for the inner stage. with --trace the stages and bands are also recorded as spans per thread and written
+// as Chrome trace events. without RASTER_STATS the macros below expand to nothing
+
+enum class Counter {
+	SHAPES,
+	SEGMENTS,
+	EVENTS,
+	STRIPS,
+	TRAPEZOIDS,
+	PIXELS,
+	PAINT_EVALUATIONS,
+	BYTES_WRITTEN,
+	COUNT
+};
+
+enum class Timer {
+	READ,
+	PARSE,
+	FLATTEN,
+	INDEX,
+	HAIRLINES,
+	EVENTS,
+	SWEEP,
+	ENCODE,
+	COUNT
+};
+
+#ifdef RASTER_STATS
+
+#include <atomic>
+#include <chrono>
+
+namespace stats {
+
+struct ThreadStats {
+	// only the owning thread writes, so a relaxed load and store is enough
+	std::atomic<std::uint64_t> counters[static_cast<int>(Counter::COUNT)];
+	std::atomic<std::uint64_t> nanoseconds[static_cast<int>(Timer::COUNT)];
+	ThreadStats();
+	~ThreadStats();
+	void add(std::atomic<std::uint64_t>& value, std::uint64_t amount) {
+		value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+	}
+};
+
+extern thread_local ThreadStats thread_stats;
+
+class ScopedTimer;
+// the innermost timer that is running on this thread
+extern thread_local ScopedTimer* current_timer;
+
+extern std::atomic<bool> tracing;
+
+// appends a span to the trace buffer of the current thread
+void trace(const char* name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end);
+const char* get_name(Timer timer);
+
+inline void count(Counter counter, std::uint64_t amount) {
+	thread_stats.add(thread_stats.counters[static_cast<int>(counter)], amount);
+}
+
+// the time of the nested timers is subtracted from the time of their parent
+class ScopedTimer {
+	Timer timer;
+	ScopedTimer* parent;
+	std::chrono::steady_clock::time_point start;
+	std::chrono::steady_clock::duration nested;
+public:
+	ScopedTimer(Timer timer): timer(timer), parent(current_timer), start(std::chrono::steady_clock::now()), nested(std::chrono::steady_clock::duration::zero()) {
+		current_timer = this;
+	}
+	ScopedTimer(const ScopedTimer&) = delete;
+	~ScopedTimer() {
+		const auto end = std::chrono::steady_clock::now();
+		current_timer = parent;
+		if (parent) {
+			parent->nested += end - start;
+		}
+		const auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start - nested);
+		thread_stats.add(thread_stats.nanoseconds[static_cast<int>(timer)], duration.count());
+		if (tracing.load(std::memory_order_relaxed)) {
+			trace(get_name(timer), start, end);
+		}
+	}
+};
+
+// a span that is only recorded in the trace, for work that is not a stage of its own like a band
+class ScopedTrace {
+	const char* name;
+	bool active;
+	std::chrono::steady_clock::time_point start;
+public:
+	ScopedTrace(const char* name): name(name), active(tracing.load(std::memory_order_relaxed)) {
+		if (active) {
+			start = std::chrono::steady_clock::now();
+		}
+	}
+	ScopedTrace(const ScopedTrace&) = delete;
+	~ScopedTrace() {
+		if (active) {
+			trace(name, start, std::chrono::steady_clock::now());
+		}
+	}
+};
+
+// the totals of all threads as a JSON object, the stage times are summed over the threads
+std::string get_json(double wall_seconds);
+
+// starts recording spans, the timestamps of the trace are relative to this call
+void start_tracing();
+// writes the spans of all threads as Chrome trace event JSON, returns false if the file could not be written
+bool write_trace(const char* file_name);
+
+}
+
+#define RASTER_COUNT(counter, amount) stats::count(Counter::counter, amount)
+#define RASTER_TIME(timer) stats::ScopedTimer raster_timer_##timer(Timer::timer)
+#define RASTER_TRACE(name) stats::ScopedTrace raster_trace(name)
+
+#else
+
+#define RASTER_COUNT(counter, amount)
+#define RASTER_TIME(timer)
+#define RASTER_TRACE(name)
+
+#endif
@@ -0,0 +1,164 @@
+/*
+
+Copyright (c) 2017-2018, Elias Aebi
+All rights reserved.
+
+*/
+
+#include "parser.hpp"
+#include <string>
+#include <vector>
+#include <iostream>
+#include <sstream>
+#include <cmath>
+
+// checks that are run by ctest, every check throws a message if it fails
+
+namespace {
+
+void check(bool condition, const std::string& message) {
+	if (!condition) {
+		throw message;
+	}
+}
+
+std::string to_string(const Point& point) {
+	std::ostringstream s;
+	s << "(" << point.x << ", " << point.y << ")";
+	return s.str();
+}
+
+// an edit round trip at another scale and tolerance must give the same pixels as a render of the edited document
+void check_retained() {
+	const char* before = R"svg(<svg xmlns="http://www.w3.org/2000/svg" width="120" height="80" viewBox="0 0 120 80">
+<rect id="background" width="120" height="80" fill="wheat"/>
+<circle id="sun" cx="30" cy="30" r="18" fill="orange"/>
+<g transform="translate(60 10) rotate(10)">
+<path id="wave" d="M0 40 C 15 10, 30 70, 45 40 S 75 10, 90 40" fill="none" stroke="teal" stroke-width="4"/>
+</g>
+<rect id="box" x="70" y="50" width="30" height="20" rx="4" fill="purple" fill-opacity="0.6"/>
+</svg>)svg";
+	const char* after = R"svg(<svg xmlns="http://www.w3.org/2000/svg" width="120" height="80" viewBox="0 0 120 80">
+<rect id="background" width="120" height="80" fill="wheat"/>
+<circle id="sun" cx="42" cy="34" r="18" fill="orange"/>
+<g transform="translate(60 10) rotate(10)">
+<path id="wave" d="M0 40 C 15 10, 30 70, 45 40 S 75 10, 90 40" fill="none" stroke="teal" stroke-width="4"/>
+</g>
+<rect id="box" x="70" y="50" width="30" height="20" rx="4" fill="purple" fill-opacity="0.6"/>
+</svg>)svg";
+	RenderOptions options;
+	options.scale = 1.5f;
+	options.tolerance = .3f;
+	RetainedDocument retained(before, options);
+	const Rectangle dirty = retained.update(after);
+	const Pixmap& incremental = retained.get_pixmap();
+
+	const Document document = parse(after, options);
+	Pixmap full(document.width, document.height);
+	Renderer renderer;
+	renderer.render(document, full, Rectangle(0.f, 0.f, full.get_width(), full.get_height()), options);
+
+	check(incremental.get_width() == full.get_width() && incremental.get_height() == full.get_height(), "the retained pixmap has a different size");
+	// only the old and the new circle are rasterized again
+	check(dirty.x0 > 0.f && dirty.x1 < full.get_width() && dirty.y1 < full.get_height(), "the whole document was rasterized again");
+	// the strips of the sweep depend on all shapes, so the coverage sums may differ in their last bits, far below a level
+	// of the 8 bit output
+	for (size_t y = 0; y < full.get_height(); ++y) {
+		for (size_t x = 0; x < full.get_width(); ++x) {
+			const Color a = incremental.get_pixel(x, y);
+			const Color b = full.get_pixel(x, y);
+			const float error = std::max(std::max(std::abs(a.r - b.r), std::abs(a.g - b.g)), std::max(std::abs(a.b - b.b), std::abs(a.a - b.a)));
+			check(error <= 1e-4f, "pixel " + std::to_string(x) + ", " + std::to_string(y) + " differs from the full render");
+		}
+	}
+}
+
+// the winding number of the shape at the point from the segments that cross the ray to its right. hit_test counts the
+// ones to its left, both only agree if the segments of every shape form closed outlines
+int get_winding(const Scene& scene, size_t shape, const Point& point) {
+	const SegmentView segments = scene.get_segments();
+	int winding = 0;
+	for (size_t i = scene.shapes[shape].first_segment; i < scene.shapes[shape].last_segment; ++i) {
+		if (segments.y0[i] <= point.y && point.y < segments.y1[i] && segments.get_line(i).get_x(point.y) > point.x) {
+			winding -= segments.direction[i];
+		}
+	}
+	return winding;
+}
+
+// the topmost shape with a nonzero winding number
+int get_topmost(const Scene& scene, const Point& point) {
+	for (size_t i = scene.shapes.size(); i-- > 0;) {
+		if (get_winding(scene, i, point) != 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void check_hit_test() {
+	// a background, two overlapping circles, a self-intersecting star whose center winds twice and a square whose inner
+	// square winds the other way and leaves a hole
+	const char* svg = R"svg(<svg xmlns="http://www.w3.org/2000/svg" width="200" height="200">
+<rect x="10" y="10" width="180" height="180" fill="grey"/>
+<circle cx="60" cy="60" r="40" fill="red"/>
+<circle cx="90" cy="70" r="35" fill="blue"/>
+<polygon points="150,20 170,80 115,43 185,43 130,80" fill="green"/>
+<path d="M40 120 H 110 V 190 H 40 Z M60 140 V 170 H 90 V 140 Z" fill="orange"/>
+<path d="M120 120 H 180 V 180 H 120 Z M130 130 H 170 V 170 H 130 Z" fill="navy"/>
+</svg>)svg";
+	const Document document = parse(svg);
+	check(document.shapes.size() == 6, "expected 6 shapes");
+	// the center of the star and the inner square of the last path wind twice, the hole of the orange path is grey
+	check(document.hit_test(Point(150.5f, 55.5f)) == 3, "the center of the star is not hit");
+	check(std::abs(get_winding(document, 5, Point(150.5f, 150.5f))) == 2, "the inner square does not wind twice");
+	check(document.hit_test(Point(150.5f, 150.5f)) == 5, "the twice wound square is not hit");
+	check(document.hit_test(Point(75.5f, 155.5f)) == 0, "the hole is not transparent");
+	check(document.hit_test(Point(75.5f, 75.5f)) == 2, "the upper circle is not hit");
+	check(document.hit_test(Point(5.5f, 5.5f)) == -1, "a point outside all shapes is hit");
+	for (float y = .37f; y < 200.f; y += 3.f) {
+		for (float x = .61f; x < 200.f; x += 3.f) {
+			const Point point(x, y);
+			const int expected = get_topmost(document, point);
+			const int result = document.hit_test(point);
+			check(result == expected, "hit_test" + to_string(point) + " returned " + std::to_string(result) + " instead of " + std::to_string(expected));
+		}
+	}
+}
+
+struct Check {
+	const char* name;
+	void (*run)();
+};
+
+const Check checks[] = {
+	{"retained", check_retained},
+	{"hit_test", check_hit_test}
+};
+
+}
+
+int main(int argc, char** argv) {
+	if (argc < 2) {
+		std::cout << "usage: raster_test <check>" << std::endl;
+		std::cout << "checks:";
+		for (const Check& check: checks) {
+			std::cout << " " << check.name;
+		}
+		std::cout << std::endl;
+		return 0;
+	}
+	for (const Check& check: checks) {
+		if (std::string(argv[1]) == check.name) {
+			try {
+				check.run();
+			} catch (const std::string& error) {
+				std::cerr << "error: " << check.name << ": " << error << std::endl;
+				return 1;
+			}
+			return 0;
+		}
+	}
+	std::cerr << "error: unknown check " << argv[1] << std::endl;
+	return 1;
+}